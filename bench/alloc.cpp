@@ -0,0 +1,46 @@
+// Cost of creating a state, running a short allocation-heavy chunk and closing the state again, with the system
+// allocator (luaL_newstate) and with both modes of lua::Allocator.
+//
+// The output is CSV: allocator,us_per_state
+#include <chrono>
+#include <cstdio>
+#include <memory>
+
+#include <lua-cts-alloc.hpp>
+
+namespace {
+constexpr auto states = 2000;
+constexpr auto chunk = "local t = {} for i = 1, 200 do t[i] = {i, i .. ''} end";
+
+template <typename NewState>
+void run(const char* name, NewState&& newstate)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < states; i++) {
+        newstate([] (lua_State* state) {
+            if (luaL_dostring(state, chunk) != LUA_OK) {
+                std::fprintf(stderr, "%s\n", lua_tostring(state, -1));
+            }
+            lua_close(state);
+        });
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    std::printf("%s,%.2f\n", name, elapsed / states);
+}
+}
+
+int main()
+{
+    std::printf("allocator,us_per_state\n");
+    run("system", [] (auto&& body) {
+        body(luaL_newstate());
+    });
+    run("free_list", [] (auto&& body) {
+        auto allocator = lua::Allocator(lua::Allocator::Mode::FreeList);
+        body(allocator.newstate());
+    });
+    run("arena", [] (auto&& body) {
+        auto allocator = lua::Allocator(lua::Allocator::Mode::Arena);
+        body(allocator.newstate());
+    });
+}
@@ -0,0 +1,65 @@
+// Cost of loading a large chunk into a fresh state, compiled from source and taken from a warm lua::BytecodeCache.
+//
+// The output is CSV: source,us_per_load
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+#include <unistd.h>
+
+#include <lua-cts-cache.hpp>
+
+namespace {
+constexpr auto loads = 500;
+
+// A few hundred small functions, roughly what a state loads at startup.
+std::string make_chunk()
+{
+    auto chunk = std::string("local M = {}\n");
+    for (auto i = 0; i < 500; i++) {
+        auto n = std::to_string(i);
+        chunk += "function M.f" + n + "(t, x)\n"
+            "  local sum = 0\n"
+            "  for k, v in pairs(t) do if type(v) == 'number' then sum = sum + v * " + n + " end end\n"
+            "  return sum + (x or 0), tostring(sum) .. '" + n + "'\n"
+            "end\n";
+    }
+    return chunk + "return M\n";
+}
+
+template <typename Load>
+void run(const char* name, Load&& load)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < loads; i++) {
+        auto state = std::unique_ptr<lua_State, decltype(&lua_close)>(luaL_newstate(), lua_close);
+        auto s = load(lua::StackWrapper<>(state.get()), [] (auto s) {
+            return s.template pop<1>();
+        }, [] (auto s) {
+            return s.template tostring<1>([] (const char* error) { std::fprintf(stderr, "%s\n", error); }).template pop<1>();
+        });
+        (void)s;
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    std::printf("%s,%.2f\n", name, elapsed / loads);
+}
+}
+
+int main()
+{
+    auto chunk = make_chunk();
+    auto directory = std::filesystem::temp_directory_path() / ("lua-cts-bench-cache-" + std::to_string(::getpid()));
+    std::filesystem::create_directories(directory);
+    auto cache = lua::BytecodeCache(directory);
+
+    std::printf("source,us_per_load\n");
+    run("parse", [&chunk] (auto s, auto&& on_success, auto&& on_error) {
+        return s.load(chunk, "=bench", on_success, on_error);
+    });
+    run("cache", [&chunk, &cache] (auto s, auto&& on_success, auto&& on_error) {
+        return cache.load(s, chunk, "=bench", on_success, on_error);
+    });
+    std::filesystem::remove_all(directory);
+}
@@ -0,0 +1,46 @@
+# Measures how long it takes to compile compile_time.cpp and how much memory the compiler needs, for synthetic stacks of
+# increasing depth. Prints CSV: depth,seconds,max_rss_kb
+# max_rss_kb is left empty when GNU time isn't available.
+#
+# Usage: cmake -DCXX=<compiler> -DSOURCE=<compile_time.cpp> -DINCLUDE_DIRS=<dir1|dir2> -P compile_time.cmake
+
+find_program(TIME_EXECUTABLE time PATHS /usr/bin NO_DEFAULT_PATH)
+
+string(REPLACE "|" ";" INCLUDE_DIRS "${INCLUDE_DIRS}")
+set(INCLUDE_FLAGS)
+foreach(dir ${INCLUDE_DIRS})
+    list(APPEND INCLUDE_FLAGS "-I${dir}")
+endforeach()
+
+execute_process(COMMAND ${CMAKE_COMMAND} -E echo "depth,seconds,max_rss_kb")
+
+foreach(depth 25 50 100 150 200)
+    set(COMMAND ${CXX} -std=c++17 -fsyntax-only ${INCLUDE_FLAGS} -DLUA_CTS_BENCH_DEPTH=${depth} ${SOURCE})
+    if (TIME_EXECUTABLE)
+        set(COMMAND ${TIME_EXECUTABLE} -f "%M" ${COMMAND})
+    endif()
+
+    string(TIMESTAMP start "%s%f" UTC)
+    execute_process(COMMAND ${COMMAND} RESULT_VARIABLE result ERROR_VARIABLE output)
+    string(TIMESTAMP end "%s%f" UTC)
+
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "Compilation with depth ${depth} failed:\n${output}")
+    endif()
+
+    math(EXPR elapsed_us "${end} - ${start}")
+    math(EXPR seconds "${elapsed_us} / 1000000")
+    math(EXPR fraction "${elapsed_us} % 1000000 / 1000")
+    string(LENGTH "${fraction}" fraction_length)
+    while(fraction_length LESS 3)
+        string(PREPEND fraction "0")
+        string(LENGTH "${fraction}" fraction_length)
+    endwhile()
+
+    set(max_rss "")
+    if (TIME_EXECUTABLE AND output MATCHES "([0-9]+)[ \t\r\n]*$")
+        set(max_rss "${CMAKE_MATCH_1}")
+    endif()
+
+    execute_process(COMMAND ${CMAKE_COMMAND} -E echo "${depth},${seconds}.${fraction},${max_rss}")
+endforeach()
@@ -0,0 +1,47 @@
+// Compile time benchmark, compiled by compile_time.cmake with increasing values of LUA_CTS_BENCH_DEPTH.
+//
+// Instantiates every type list algorithm once for every index of a synthetic stack, the same way generated binding
+// code does for deep stacks.
+#include <utility>
+
+#include <lua-cts.hpp>
+
+#ifndef LUA_CTS_BENCH_DEPTH
+#define LUA_CTS_BENCH_DEPTH 50
+#endif
+
+namespace {
+constexpr int depth = LUA_CTS_BENCH_DEPTH;
+
+template <std::size_t I>
+using element = lua::nth_type_t<I % 4, lua::Number, lua::String, lua::Table, lua::Nil>;
+
+template <typename S>
+struct synthetic_stack;
+
+template <std::size_t... Is>
+struct synthetic_stack<std::index_sequence<Is...>> {
+    using type = lua::StackWrapper<element<Is>...>;
+};
+
+using Stack = synthetic_stack<std::make_index_sequence<depth>>::type;
+
+template <std::size_t... Is>
+constexpr int exercise(std::index_sequence<Is...>)
+{
+    return (0 + ... + (
+        lua::rotate_t<Stack, 1, Is>::stack_size
+        + lua::rotate_t<Stack, -int(Is) - 1, 1>::stack_size
+        + lua::pop_front_t<Stack, Is>::stack_size
+        + lua::pop_back_t<Stack, Is>::stack_size
+        + lua::replace_type_t<Stack, Is + 1, lua::Unknown>::stack_size
+        + lua::append_times_t<Stack, lua::Unknown, Is>::stack_size
+        + int{sizeof(lua::select_type_t<Stack, Is + 1>)}));
+}
+}
+
+static_assert(exercise(std::make_index_sequence<depth>{}) > 0);
+
+int main()
+{
+}
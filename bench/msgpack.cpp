@@ -0,0 +1,153 @@
+// Cost of serializing a table of records to MessagePack, directly from the stack with tomsgpack and by first converting
+// the table to C++ values, as well as decoding it again with pushmsgpack.
+//
+// The output is CSV: variant,us_per_message,bytes
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <lua-cts-msgpack.hpp>
+
+namespace {
+constexpr auto messages = 200;
+constexpr auto chunk = R"(
+local records = {}
+for i = 1, 1000 do
+    records[i] = {id = i, name = 'user' .. i, score = i * 0.5, active = i % 2 == 0, tags = {'a', 'b', 'c'}}
+end
+return records
+)";
+
+// A copy of a Lua value, the intermediate step of the naive path.
+struct Node {
+    int type = LUA_TNIL;
+    bool boolean = false;
+    bool integer = false;
+    lua_Integer i = 0;
+    lua_Number n = 0;
+    std::string string;
+    std::vector<Node> keys;
+    std::vector<Node> values;
+};
+
+Node to_node(lua_State* state, int index)
+{
+    index = lua_absindex(state, index);
+    auto node = Node{};
+    node.type = lua_type(state, index);
+    switch (node.type) {
+    case LUA_TBOOLEAN:
+        node.boolean = lua_toboolean(state, index);
+        break;
+    case LUA_TNUMBER:
+        node.integer = lua_isinteger(state, index);
+        node.i = lua_tointeger(state, index);
+        node.n = lua_tonumber(state, index);
+        break;
+    case LUA_TSTRING:
+        node.string = lua_tostring(state, index);
+        break;
+    case LUA_TTABLE:
+        lua_pushnil(state);
+        while (lua_next(state, index)) {
+            node.keys.push_back(to_node(state, -2));
+            node.values.push_back(to_node(state, -1));
+            lua_pop(state, 1);
+        }
+        break;
+    }
+    return node;
+}
+
+void put(std::string& out, unsigned char prefix, std::uint64_t value, int bytes)
+{
+    out.push_back(static_cast<char>(prefix));
+    for (auto i = bytes - 1; i >= 0; i--) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+// Writes every table as a map, and doesn't bother with the shortest encodings.
+void write_node(const Node& node, std::string& out)
+{
+    switch (node.type) {
+    case LUA_TBOOLEAN:
+        out.push_back(static_cast<char>(node.boolean ? 0xc3 : 0xc2));
+        break;
+    case LUA_TNUMBER:
+        if (node.integer) {
+            put(out, 0xd3, static_cast<std::uint64_t>(node.i), 8);
+        } else {
+            auto bits = std::uint64_t{};
+            std::memcpy(&bits, &node.n, sizeof(bits));
+            put(out, 0xcb, bits, 8);
+        }
+        break;
+    case LUA_TSTRING:
+        put(out, 0xdb, node.string.size(), 4);
+        out += node.string;
+        break;
+    case LUA_TTABLE:
+        put(out, 0xdf, node.keys.size(), 4);
+        for (auto i = std::size_t{0}; i < node.keys.size(); i++) {
+            write_node(node.keys[i], out);
+            write_node(node.values[i], out);
+        }
+        break;
+    default:
+        out.push_back(static_cast<char>(0xc0));
+    }
+}
+
+template <typename Body>
+void run(const char* name, Body&& body)
+{
+    auto size = std::size_t{0};
+    auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < messages; i++) {
+        size = body();
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    std::printf("%s,%.2f,%zu\n", name, elapsed / messages, size);
+}
+}
+
+int main()
+{
+    auto state = std::unique_ptr<lua_State, decltype(&lua_close)>(luaL_newstate(), lua_close);
+    if (luaL_dostring(state.get(), chunk)) {
+        std::fprintf(stderr, "%s\n", lua_tostring(state.get(), -1));
+        return 1;
+    }
+    auto s = lua::StackWrapper<lua::Unknown>(state.get());
+
+    std::printf("variant,us_per_message,bytes\n");
+    auto bytes = std::string();
+    run("encode_direct", [&s, &bytes] {
+        bytes.clear();
+        (void)s.tomsgpack<1>(bytes, [] (lua::MessagePackResult result) {
+            if (!result) {
+                std::fprintf(stderr, "%s\n", result.message());
+            }
+        });
+        return bytes.size();
+    });
+    run("encode_via_cpp", [L = state.get()] {
+        auto out = std::string();
+        write_node(to_node(L, 1), out);
+        return out.size();
+    });
+    run("decode", [&s, &bytes] {
+        (void)s.pushmsgpack(bytes, [] (auto s) {
+            return s.template pop<1>();
+        }, [] (auto s, lua::MessagePackResult result) {
+            std::fprintf(stderr, "%s\n", result.message());
+            return s;
+        });
+        return bytes.size();
+    });
+}
@@ -0,0 +1,61 @@
+// Throughput of a lua::StatePool with an increasing number of workers.
+//
+// Every task calls a Lua function doing a fixed amount of work. The output is CSV: workers,tasks_per_second,speedup
+// where speedup is relative to a single worker. Scaling should be close to linear up to the number of cores.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <lua-cts-pool.hpp>
+
+namespace {
+constexpr auto tasks = 20000;
+
+void load_work(lua_State* state)
+{
+    if (luaL_loadstring(state, "function work(n) local x = 0 for i = 1, n do x = x + i * i end return x end") != LUA_OK) {
+        throw std::runtime_error("Can't load the chunk");
+    }
+    lua_call(state, 0, 0);
+}
+
+double tasks_per_second(unsigned workers)
+{
+    auto pool = lua::StatePool(workers, load_work);
+    auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < tasks; i++) {
+        pool.submit([] (lua_State* state) {
+            lua_getglobal(state, "work");
+            auto s = lua::StackWrapper<lua::Function>(state).pushinteger(2000).call<1, 1>();
+            (void)s;
+        });
+    }
+    pool.wait_idle();
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return tasks / elapsed;
+}
+}
+
+int main()
+{
+    // Powers of two, and all the cores.
+    auto cores = std::max(1u, std::thread::hardware_concurrency());
+    auto counts = std::vector<unsigned>();
+    for (auto workers = 1u; workers < cores; workers *= 2) {
+        counts.push_back(workers);
+    }
+    counts.push_back(cores);
+
+    std::printf("workers,tasks_per_second,speedup\n");
+    auto single = 0.0;
+    for (auto workers : counts) {
+        auto throughput = tasks_per_second(workers);
+        if (workers == 1) {
+            single = throughput;
+        }
+        std::printf("%u,%.0f,%.2f\n", workers, throughput, throughput / single);
+    }
+}
@@ -0,0 +1,347 @@
+// Runtime cost of StackWrapper chains compared to the equivalent raw Lua C API calls.
+//
+// Every benchmark runs over stacks of increasing depth, since the wrapper's runtime checks scale with the stack size.
+// The output is CSV: benchmark,variant,depth,ns_per_op,instructions_per_op
+// instructions_per_op is left empty when hardware performance counters aren't available.
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string_view>
+#include <utility>
+
+#include <lua-cts.hpp>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+template <typename T>
+void do_not_optimize(const T& value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+class InstructionCounter {
+public:
+    InstructionCounter()
+    {
+#ifdef __linux__
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    InstructionCounter(const InstructionCounter&) = delete;
+    InstructionCounter& operator=(const InstructionCounter&) = delete;
+
+    ~InstructionCounter()
+    {
+#ifdef __linux__
+        if (m_fd != -1) {
+            close(m_fd);
+        }
+#endif
+    }
+
+    [[nodiscard]] bool available() const
+    {
+        return m_fd != -1;
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        if (available()) {
+            ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    std::uint64_t stop()
+    {
+        std::uint64_t count = 0;
+#ifdef __linux__
+        if (available()) {
+            ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(m_fd, &count, sizeof(count)) != sizeof(count)) {
+                count = 0;
+            }
+        }
+#endif
+        return count;
+    }
+
+private:
+    int m_fd = -1;
+};
+
+class Runner {
+public:
+    template <typename Body>
+    void run(const char* benchmark, const char* variant, int depth, Body&& body)
+    {
+        using clock = std::chrono::steady_clock;
+        constexpr auto min_duration = std::chrono::milliseconds(20);
+
+        // Find an iteration count that runs long enough for the clock resolution not to matter.
+        auto iterations = std::int64_t{1000};
+        while (true) {
+            auto start = clock::now();
+            for (auto i = std::int64_t{0}; i < iterations; i++) {
+                body(i);
+            }
+            if (clock::now() - start >= min_duration) {
+                break;
+            }
+            iterations *= 2;
+        }
+
+        m_counter.start();
+        auto start = clock::now();
+        for (auto i = std::int64_t{0}; i < iterations; i++) {
+            body(i);
+        }
+        auto elapsed = clock::now() - start;
+        auto instructions = m_counter.stop();
+
+        auto ns_per_op = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+        std::printf("%s,%s,%d,%.2f,", benchmark, variant, depth, ns_per_op);
+        if (m_counter.available()) {
+            std::printf("%.1f", static_cast<double>(instructions) / iterations);
+        }
+        std::printf("\n");
+    }
+
+private:
+    InstructionCounter m_counter;
+};
+
+using StatePtr = std::unique_ptr<lua_State, decltype(&lua_close)>;
+
+StatePtr make_state(int numbers)
+{
+    auto state = StatePtr(luaL_newstate(), lua_close);
+    // Lua only guarantees LUA_MINSTACK free slots, the deeper benchmarks need more (plus a few for the measured ops).
+    lua_checkstack(state.get(), numbers + LUA_MINSTACK);
+    for (auto i = 0; i < numbers; i++) {
+        lua_pushinteger(state.get(), i);
+    }
+    return state;
+}
+
+int bench_function(lua_State* state)
+{
+    lua_pushinteger(state, lua_gettop(state));
+    return 1;
+}
+
+template <int Depth>
+using NumberStack = lua::append_times_t<lua::StackWrapper<>, lua::Number, Depth>;
+
+template <int Depth>
+void push_pop(Runner& runner)
+{
+    auto state = make_state(Depth);
+    auto s = NumberStack<Depth>(state.get());
+    runner.run("push_pop", "wrapper", Depth, [&s] (std::int64_t i) {
+        do_not_optimize(s.pushinteger(i).pushinteger(i).template pop<2>());
+    });
+    runner.run("push_pop", "raw", Depth, [L = state.get()] (std::int64_t i) {
+        lua_pushinteger(L, i);
+        lua_pushinteger(L, i);
+        lua_pop(L, 2);
+    });
+}
+
+template <int Depth>
+void rotate_insert(Runner& runner)
+{
+    auto state = make_state(Depth);
+    auto s = NumberStack<Depth>(state.get());
+    runner.run("rotate_insert", "wrapper", Depth, [&s] (std::int64_t) {
+        do_not_optimize(s.pushnil().template insert<1>().template rotate<1, Depth>().template pop<1>());
+    });
+    runner.run("rotate_insert", "raw", Depth, [L = state.get()] (std::int64_t) {
+        lua_pushnil(L);
+        lua_insert(L, 1);
+        lua_rotate(L, 1, Depth);
+        lua_pop(L, 1);
+    });
+}
+
+template <int Depth>
+void getfield_setfield(Runner& runner)
+{
+    auto state = make_state(0);
+    lua_checkstack(state.get(), Depth + LUA_MINSTACK);
+    lua_newtable(state.get());
+    for (auto i = 1; i < Depth; i++) {
+        lua_pushinteger(state.get(), i);
+    }
+    auto s = lua::append_times_t<lua::StackWrapper<lua::Table>, lua::Number, Depth - 1>(state.get());
+    runner.run("getfield_setfield", "wrapper", Depth, [&s] (std::int64_t i) {
+        do_not_optimize(s.pushinteger(i).template setfield<1>("key").template getfield<1>("key").template pop<1>());
+    });
+    runner.run("getfield_setfield", "raw", Depth, [L = state.get()] (std::int64_t i) {
+        lua_pushinteger(L, i);
+        lua_setfield(L, 1, "key");
+        lua_getfield(L, 1, "key");
+        lua_pop(L, 1);
+    });
+}
+
+template <int Depth>
+void call_pcall(Runner& runner)
+{
+    auto state = make_state(Depth);
+    auto s = NumberStack<Depth>(state.get());
+    runner.run("call", "wrapper", Depth, [&s] (std::int64_t i) {
+        do_not_optimize(s.pushcfunction(bench_function).pushinteger(i).pushinteger(i).pushinteger(i)
+            .template call<3, 1>().template pop<1>());
+    });
+    runner.run("call", "raw", Depth, [L = state.get()] (std::int64_t i) {
+        lua_pushcfunction(L, bench_function);
+        lua_pushinteger(L, i);
+        lua_pushinteger(L, i);
+        lua_pushinteger(L, i);
+        lua_call(L, 3, 1);
+        lua_pop(L, 1);
+    });
+    runner.run("pcall", "wrapper", Depth, [&s] (std::int64_t i) {
+        do_not_optimize(s.pushcfunction(bench_function).pushinteger(i).pushinteger(i).pushinteger(i)
+            .template pcall<3, 1, 0>().template resolve<lua::Number>().template pop<1>());
+    });
+    runner.run("pcall", "raw", Depth, [L = state.get()] (std::int64_t i) {
+        lua_pushcfunction(L, bench_function);
+        lua_pushinteger(L, i);
+        lua_pushinteger(L, i);
+        lua_pushinteger(L, i);
+        if (lua_pcall(L, 3, 1, 0) == LUA_OK) {
+            do_not_optimize(lua_type(L, -1));
+        }
+        lua_pop(L, 1);
+    });
+}
+
+template <int Depth>
+void tostring_tointeger(Runner& runner)
+{
+    auto state = make_state(Depth);
+    auto s = NumberStack<Depth>(state.get());
+    runner.run("tostring", "wrapper", Depth, [&s] (std::int64_t) {
+        do_not_optimize(s.pushstring("value").template tostring<-1>([] (const char* str) { do_not_optimize(str); })
+            .template pop<1>());
+    });
+    runner.run("tostring", "raw", Depth, [L = state.get()] (std::int64_t) {
+        lua_pushstring(L, "value");
+        do_not_optimize(lua_tostring(L, -1));
+        lua_pop(L, 1);
+    });
+    runner.run("tolstring", "wrapper", Depth, [&s] (std::int64_t) {
+        do_not_optimize(s.pushliteral("value").template tolstring<-1>([] (std::string_view str) { do_not_optimize(str); })
+            .template pop<1>());
+    });
+    runner.run("tolstring", "raw", Depth, [L = state.get()] (std::int64_t) {
+        lua_pushlstring(L, "value", 5);
+        std::size_t length;
+        do_not_optimize(lua_tolstring(L, -1, &length));
+        do_not_optimize(length);
+        lua_pop(L, 1);
+    });
+    runner.run("tointeger", "wrapper", Depth, [&s] (std::int64_t) {
+        do_not_optimize(s.template tointeger<-1>([] (lua_Integer x) { do_not_optimize(x); }));
+    });
+    runner.run("tointeger", "raw", Depth, [L = state.get()] (std::int64_t) {
+        do_not_optimize(lua_tointeger(L, -1));
+    });
+}
+
+template <int Depth>
+void callback_lookup(Runner& runner)
+{
+    auto state = make_state(Depth);
+    lua_pushcfunction(state.get(), bench_function);
+    lua_setglobal(state.get(), "callback");
+    auto callback = lua::Ref<lua::Function>();
+    auto s = NumberStack<Depth>(state.get()).pushcfunction(bench_function).ref(callback);
+    runner.run("callback_lookup", "pushref", Depth, [&s, &callback] (std::int64_t) {
+        do_not_optimize(s.pushref(callback).template pop<1>());
+    });
+    runner.run("callback_lookup", "getglobal", Depth, [L = state.get()] (std::int64_t) {
+        lua_getglobal(L, "callback");
+        lua_pop(L, 1);
+    });
+}
+
+template <int Depth>
+void prepared_call(Runner& runner)
+{
+    auto state = make_state(Depth);
+    auto function = lua::PreparedCall<lua_Integer(lua_Integer, lua_Integer, lua_Integer)>();
+    auto s = NumberStack<Depth>(state.get()).pushcfunction(bench_function).prepare(function);
+    do_not_optimize(s);
+    runner.run("prepared_call", "wrapper", Depth, [&function] (std::int64_t i) {
+        do_not_optimize(function(i, i, i));
+    });
+    lua_pushcfunction(state.get(), bench_function);
+    auto ref = luaL_ref(state.get(), LUA_REGISTRYINDEX);
+    runner.run("prepared_call", "raw", Depth, [L = state.get(), ref] (std::int64_t i) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+        lua_pushinteger(L, i);
+        lua_pushinteger(L, i);
+        lua_pushinteger(L, i);
+        if (lua_pcall(L, 3, 1, 0) == LUA_OK && lua_isinteger(L, -1)) {
+            do_not_optimize(lua_tointeger(L, -1));
+        }
+        lua_pop(L, 1);
+    });
+}
+
+// The kind of redundant sequence generated binding code produces, run eagerly and through a lazy chain.
+template <int Depth>
+void redundant_chain(Runner& runner)
+{
+    auto state = make_state(Depth);
+    auto s = NumberStack<Depth>(state.get());
+    runner.run("redundant_chain", "wrapper", Depth, [&s] (std::int64_t i) {
+        do_not_optimize(s.pushinteger(i).pushnil().template rotate<1, 1>().template rotate<1, -1>()
+            .template pop<1>().template pop<1>());
+    });
+    runner.run("redundant_chain", "lazy", Depth, [&s] (std::int64_t i) {
+        do_not_optimize(s.lazy().pushinteger(i).pushnil().template rotate<1, 1>().template rotate<1, -1>()
+            .template pop<1>().template pop<1>().run());
+    });
+}
+
+template <int... Depths>
+void run_all(Runner& runner, std::integer_sequence<int, Depths...>)
+{
+    (push_pop<Depths>(runner), ...);
+    (rotate_insert<Depths>(runner), ...);
+    (getfield_setfield<Depths>(runner), ...);
+    (call_pcall<Depths>(runner), ...);
+    (tostring_tointeger<Depths>(runner), ...);
+    (callback_lookup<Depths>(runner), ...);
+    (prepared_call<Depths>(runner), ...);
+    (redundant_chain<Depths>(runner), ...);
+}
+}
+
+int main()
+{
+    auto runner = Runner();
+    std::printf("benchmark,variant,depth,ns_per_op,instructions_per_op\n");
+    run_all(runner, std::integer_sequence<int, 1, 2, 4, 8, 16, 32, 64>{});
+}
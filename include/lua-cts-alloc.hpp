@@ -0,0 +1,308 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <lua-cts.hpp>
+
+namespace lua {
+// Counters of a lua::Allocator. Sizes are the sizes Lua asked for.
+struct AllocatorStats {
+    constexpr static std::size_t size_classes = 16;
+
+    std::size_t live_bytes = 0;
+    std::size_t peak_bytes = 0;
+    // Memory taken from the system, including the unused parts of chunks.
+    std::size_t reserved_bytes = 0;
+    // Allocations (and reallocations that moved to a bigger size class) per size class. Class i holds blocks of up to
+    // (i + 1) * alignof(std::max_align_t) bytes, the last entry counts larger blocks.
+    std::array<std::uint64_t, size_classes + 1> allocations{};
+    // Allocations refused because of the memory limit.
+    std::uint64_t refused = 0;
+};
+
+// A lua_Alloc for a single state, or for several states used by the same thread. Lua tells the allocator the size of
+// every block it frees, so blocks don't need any headers. There are two modes:
+// - FreeList: small blocks are carved out of big chunks and reused through a free list per size class, larger blocks
+//   come from malloc. Good for long-lived states.
+// - Arena: every block is carved out of chunks, and freeing does nothing. All the memory is released at once when the
+//   allocator is destroyed, which makes it the cheapest option for short-lived states, for example one per request.
+// A non-zero `limit` caps the live bytes. Allocations past it fail, and Lua raises a memory error.
+// The allocator must outlive its states:
+// auto allocator = lua::Allocator(lua::Allocator::Mode::Arena, 1024 * 1024);
+// auto state = allocator.newstate();
+class Allocator {
+public:
+    enum class Mode {
+        FreeList,
+        Arena,
+    };
+
+    constexpr static std::size_t granularity = alignof(std::max_align_t);
+    constexpr static std::size_t max_small_size = granularity * AllocatorStats::size_classes;
+
+    explicit Allocator(Mode mode = Mode::FreeList, std::size_t limit = 0, std::size_t chunk_size = 64 * 1024)
+        : m_mode(mode)
+        , m_limit(limit)
+        , m_chunk_size(chunk_size)
+    {
+    }
+
+    // States point to the allocator.
+    Allocator(const Allocator&) = delete;
+    Allocator& operator=(const Allocator&) = delete;
+
+    ~Allocator()
+    {
+        for (auto chunk : m_chunks) {
+            std::free(chunk);
+        }
+    }
+
+    // Creates a state using this allocator. Like luaL_newstate, it prints the error message of unprotected errors.
+    [[nodiscard]] lua_State* newstate()
+    {
+        auto state = lua_newstate(&allocate, this);
+        if (state) {
+            lua_atpanic(state, &panic);
+        }
+        return state;
+    }
+
+    // The lua_Alloc function, `userdata` is the allocator.
+    static void* allocate(void* userdata, void* ptr, std::size_t osize, std::size_t nsize) noexcept
+    {
+        return static_cast<Allocator*>(userdata)->reallocate(ptr, ptr ? osize : 0, nsize);
+    }
+
+    [[nodiscard]] const AllocatorStats& stats() const
+    {
+        return m_stats;
+    }
+
+    // Changes the limit, 0 removes it. Memory which is already allocated is kept.
+    void set_limit(std::size_t limit)
+    {
+        m_limit = limit;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    constexpr static std::size_t large_class = AllocatorStats::size_classes;
+
+    static std::size_t size_class(std::size_t size)
+    {
+        return size > max_small_size ? large_class : (size + granularity - 1) / granularity - 1;
+    }
+
+    static std::size_t round_up(std::size_t size)
+    {
+        return (size + granularity - 1) / granularity * granularity;
+    }
+
+    static int panic(lua_State* state)
+    {
+        auto message = lua_type(state, -1) == LUA_TSTRING ? lua_tostring(state, -1) : "error object is not a string";
+        std::fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", message);
+        return 0;
+    }
+
+    void* reallocate(void* ptr, std::size_t osize, std::size_t nsize)
+    {
+        if (nsize == 0) {
+            if (ptr) {
+                release(ptr, osize);
+                m_stats.live_bytes -= osize;
+            }
+            return nullptr;
+        }
+
+        // Shrinking is never refused, it's how the memory is given back.
+        if (m_limit != 0 && nsize > osize && m_stats.live_bytes - osize + nsize > m_limit) {
+            m_stats.refused++;
+            return nullptr;
+        }
+
+        auto old_class = size_class(osize);
+        auto new_class = size_class(nsize);
+        // Lua assumes that shrinking a block never fails. Whenever a smaller block can't be had, the old one is kept.
+        auto shrinking = ptr && nsize <= osize;
+        void* result = nullptr;
+        if (ptr && old_class == new_class && old_class != large_class) {
+            // The block is already big enough.
+            result = ptr;
+        } else if (ptr && m_mode == Mode::Arena && resize_in_place(ptr, osize, nsize)) {
+            result = ptr;
+        } else if (shrinking && m_mode == Mode::Arena) {
+            // Arena blocks are never reused, moving to a smaller one would only waste more of the chunk.
+            result = ptr;
+        } else if (ptr && old_class == large_class && new_class == large_class && m_mode == Mode::FreeList) {
+            result = std::realloc(ptr, nsize);
+            if (!result) {
+                if (!shrinking) {
+                    return nullptr;
+                }
+                result = ptr;
+            }
+            // Large blocks are freed with the size Lua reports, so that's what counts as reserved.
+            m_stats.reserved_bytes = m_stats.reserved_bytes - osize + nsize;
+        } else {
+            result = acquire(nsize);
+            if (!result && !shrinking) {
+                return nullptr;
+            }
+            if (!result) {
+                result = ptr;
+                if (old_class == large_class) {
+                    adopt(ptr);
+                }
+            } else if (ptr) {
+                std::memcpy(result, ptr, std::min(osize, nsize));
+                release(ptr, osize);
+            }
+            if (!ptr || new_class > old_class) {
+                m_stats.allocations[new_class]++;
+            }
+        }
+
+        m_stats.live_bytes = m_stats.live_bytes - osize + nsize;
+        m_stats.peak_bytes = std::max(m_stats.peak_bytes, m_stats.live_bytes);
+        return result;
+    }
+
+    void* acquire(std::size_t size)
+    {
+        auto cls = size_class(size);
+        if (m_mode == Mode::Arena) {
+            return carve(round_up(size));
+        }
+
+        if (cls == large_class) {
+            if (!reserve_chunks(1)) {
+                return nullptr;
+            }
+            auto block = std::malloc(size);
+            if (block) {
+                m_large_blocks++;
+                m_stats.reserved_bytes += size;
+            }
+            return block;
+        }
+
+        if (auto block = m_free[cls]) {
+            m_free[cls] = block->next;
+            return block;
+        }
+        return carve((cls + 1) * granularity);
+    }
+
+    void release(void* ptr, std::size_t size)
+    {
+        if (m_mode == Mode::Arena) {
+            return;
+        }
+
+        auto cls = size_class(size);
+        if (cls == large_class) {
+            std::free(ptr);
+            m_large_blocks--;
+            m_stats.reserved_bytes -= size;
+            return;
+        }
+
+        auto block = static_cast<FreeBlock*>(ptr);
+        block->next = m_free[cls];
+        m_free[cls] = block;
+    }
+
+    // The block carved last can grow or shrink in place, as long as it stays within the current chunk.
+    bool resize_in_place(void* ptr, std::size_t osize, std::size_t nsize)
+    {
+        auto block = static_cast<char*>(ptr);
+        if (block + round_up(osize) != m_cursor || round_up(nsize) > static_cast<std::size_t>(m_end - block)) {
+            return false;
+        }
+        m_cursor = block + round_up(nsize);
+        return true;
+    }
+
+    // Takes `size` bytes (a multiple of the granularity) from the current chunk. Blocks bigger than a quarter of a chunk
+    // get a chunk of their own, so that they don't waste the rest of the current one.
+    void* carve(std::size_t size)
+    {
+        if (size > m_chunk_size / 4) {
+            return new_chunk(size);
+        }
+
+        if (static_cast<std::size_t>(m_end - m_cursor) < size) {
+            auto chunk = static_cast<char*>(new_chunk(m_chunk_size));
+            if (!chunk) {
+                return nullptr;
+            }
+            m_cursor = chunk;
+            m_end = chunk + m_chunk_size;
+        }
+
+        auto block = m_cursor;
+        m_cursor += size;
+        return block;
+    }
+
+    void* new_chunk(std::size_t size)
+    {
+        if (!reserve_chunks(1)) {
+            return nullptr;
+        }
+        auto chunk = std::malloc(size);
+        if (!chunk) {
+            return nullptr;
+        }
+        m_chunks.push_back(chunk);
+        m_stats.reserved_bytes += size;
+        return chunk;
+    }
+
+    // A large block which had to stay in place when it was shrunk to a small size class. Lua will release it into a
+    // free list, so it becomes a chunk, which frees it with the others. Its size stays reserved until then.
+    void adopt(void* block)
+    {
+        m_large_blocks--;
+        m_chunks.push_back(block);
+    }
+
+    // Makes room in m_chunks for `extra` more chunks, plus every large block which may still be adopted. adopt() runs
+    // when memory has already run out, so its push_back must not allocate.
+    bool reserve_chunks(std::size_t extra)
+    {
+        auto needed = m_chunks.size() + m_large_blocks + extra;
+        if (needed <= m_chunks.capacity()) {
+            return true;
+        }
+        try {
+            m_chunks.reserve(std::max(needed, m_chunks.capacity() * 2));
+        } catch (...) {
+            return false;
+        }
+        return true;
+    }
+
+    Mode m_mode;
+    std::size_t m_limit;
+    std::size_t m_chunk_size;
+    AllocatorStats m_stats;
+    std::array<FreeBlock*, AllocatorStats::size_classes> m_free{};
+    std::vector<void*> m_chunks;
+    // Live blocks from malloc, FreeList mode only.
+    std::size_t m_large_blocks = 0;
+    char* m_cursor = nullptr;
+    char* m_end = nullptr;
+};
+}
@@ -0,0 +1,237 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <lua-cts.hpp>
+
+namespace lua {
+struct BytecodeCacheStats {
+    // Chunks loaded from the cache.
+    std::uint64_t hits = 0;
+    // Chunks compiled from source, because they weren't cached yet.
+    std::uint64_t misses = 0;
+    // Cached files which were written for another source or chunk name (a hash collision, or a foreign file), or which
+    // Lua refused to load (for example written by another Lua version). The chunk is compiled from source and the file
+    // is replaced.
+    std::uint64_t rejected = 0;
+    // Compiled chunks which couldn't be stored. The cache is only an optimization, so these aren't errors.
+    std::uint64_t write_failures = 0;
+};
+
+// Caches compiled chunks on disk, so that states which load the same sources (for example every state of a
+// lua::StatePool, or every process of a service) only parse them once. Entries are files named after a hash of the
+// source and the chunk name, holding the chunk name, the source and the lua_dump output. An entry is only used when its
+// chunk name and source are equal to the ones being loaded, and its bytecode is loaded straight from the memory-mapped
+// file, without reading it into a buffer first:
+// auto cache = lua::BytecodeCache("/var/cache/scripts");
+// auto s = cache.load(lua::StackWrapper<>(state), source, "=main", [] (auto s) {
+//     return s.template call<0, 0>();
+// }, [] (auto s) {
+//     return s.template tostring<-1>(log_error).template pop<1>();
+// });
+// Entries are written to a temporary file and renamed, so threads and processes can share a directory. Only the stats
+// are shared between threads, a single cache can be used by all of them. Stale entries are never removed.
+class BytecodeCache {
+public:
+    explicit BytecodeCache(std::filesystem::path directory)
+        : m_directory(std::move(directory))
+    {
+    }
+
+    // Like the wrapper's load() for source code, but takes the chunk from the cache if possible.
+    template <typename SW, typename OnSuccess, typename OnError>
+    auto load(SW s, std::string_view source, const char* chunkname, OnSuccess&& on_success, OnError&& on_error)
+    {
+        auto name = std::string_view(chunkname ? chunkname : "?");
+        auto path = m_directory / entry_name(source, name);
+        auto compile = [this, &source, chunkname, name, &path, &on_success, &on_error] (auto s) {
+            m_misses.fetch_add(1, std::memory_order_relaxed);
+            return s.load(source, chunkname, "t", [this, &source, name, &path, &on_success] (auto s) {
+                auto entry = entry_header(source, name);
+                auto s2 = s.template dump<-1>([&entry] (std::string_view piece) { entry.append(piece); });
+                store(path, entry);
+                return on_success(s2);
+            }, on_error);
+        };
+
+        auto mapping = Mapping(path);
+        if (!mapping) {
+            return compile(s);
+        }
+        auto bytecode = std::string_view();
+        if (!entry_bytecode(mapping.view(), source, name, bytecode)) {
+            m_rejected.fetch_add(1, std::memory_order_relaxed);
+            return compile(s);
+        }
+        return s.load(bytecode, chunkname, "b", [this, &on_success] (auto s) {
+            m_hits.fetch_add(1, std::memory_order_relaxed);
+            return on_success(s);
+        }, [this, &compile] (auto s) {
+            m_rejected.fetch_add(1, std::memory_order_relaxed);
+            return compile(s.template pop<1>());
+        });
+    }
+
+    [[nodiscard]] BytecodeCacheStats stats() const
+    {
+        auto result = BytecodeCacheStats{};
+        result.hits = m_hits.load(std::memory_order_relaxed);
+        result.misses = m_misses.load(std::memory_order_relaxed);
+        result.rejected = m_rejected.load(std::memory_order_relaxed);
+        result.write_failures = m_write_failures.load(std::memory_order_relaxed);
+        return result;
+    }
+
+    [[nodiscard]] const std::filesystem::path& directory() const
+    {
+        return m_directory;
+    }
+
+private:
+    // A read-only mapping of a whole file. Empty if the file doesn't exist or can't be mapped.
+    class Mapping {
+    public:
+        explicit Mapping(const std::filesystem::path& path)
+        {
+            auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+            struct stat info {};
+            if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+                auto data = ::mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                    m_data = data;
+                    m_size = static_cast<std::size_t>(info.st_size);
+                }
+            }
+            // The mapping stays valid after the descriptor is closed.
+            ::close(fd);
+        }
+
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+
+        ~Mapping()
+        {
+            if (m_data) {
+                ::munmap(m_data, m_size);
+            }
+        }
+
+        explicit operator bool() const
+        {
+            return m_data != nullptr;
+        }
+
+        [[nodiscard]] std::string_view view() const
+        {
+            return std::string_view(static_cast<const char*>(m_data), m_size);
+        }
+
+    private:
+        void* m_data = nullptr;
+        std::size_t m_size = 0;
+    };
+
+    constexpr static std::string_view entry_magic = std::string_view("lua-cts\0", 8);
+
+    // FNV-1a of the chunk name and the source. The chunk name is part of the debug information in the bytecode, so the
+    // same source loaded under two names gets two entries. Colliding names are told apart by the entry header.
+    static std::string entry_name(std::string_view source, std::string_view chunkname)
+    {
+        auto hash = std::uint64_t{14695981039346656037u};
+        auto add = [&hash] (std::string_view bytes) {
+            for (auto c : bytes) {
+                hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211u;
+            }
+        };
+        add(chunkname);
+        add(std::string_view("", 1));
+        add(source);
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.luac", static_cast<unsigned long long>(hash));
+        return name;
+    }
+
+    // An entry starts with entry_magic, the lengths of the chunk name and of the source, then the chunk name and the
+    // source themselves. The bytecode follows.
+    static std::string entry_header(std::string_view source, std::string_view chunkname)
+    {
+        auto header = std::string(entry_magic);
+        for (auto length : {static_cast<std::uint64_t>(chunkname.size()), static_cast<std::uint64_t>(source.size())}) {
+            header.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        }
+        header.append(chunkname);
+        header.append(source);
+        return header;
+    }
+
+    // Finds the bytecode of `entry`, if it was written for this source and chunk name.
+    static bool entry_bytecode(
+        std::string_view entry, std::string_view source, std::string_view chunkname, std::string_view& bytecode)
+    {
+        constexpr auto lengths_size = 2 * sizeof(std::uint64_t);
+        if (entry.size() < entry_magic.size() + lengths_size || entry.substr(0, entry_magic.size()) != entry_magic) {
+            return false;
+        }
+        std::uint64_t lengths[2];
+        std::memcpy(lengths, entry.data() + entry_magic.size(), lengths_size);
+        if (lengths[0] != chunkname.size() || lengths[1] != source.size()) {
+            return false;
+        }
+
+        auto rest = entry.substr(entry_magic.size() + lengths_size);
+        if (rest.size() < chunkname.size() + source.size() || rest.substr(0, chunkname.size()) != chunkname
+            || rest.substr(chunkname.size(), source.size()) != source) {
+            return false;
+        }
+        bytecode = rest.substr(chunkname.size() + source.size());
+        return true;
+    }
+
+    void store(const std::filesystem::path& path, std::string_view entry)
+    {
+        // Unique per process and thread, so concurrent writers of the same entry don't share a temporary file.
+        auto temporary = path;
+        temporary += "." + std::to_string(::getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+
+        auto file = std::fopen(temporary.c_str(), "wb");
+        auto written = file && std::fwrite(entry.data(), 1, entry.size(), file) == entry.size();
+        if (file && std::fclose(file) != 0) {
+            written = false;
+        }
+
+        auto error = std::error_code();
+        if (written) {
+            std::filesystem::rename(temporary, path, error);
+        }
+        if (!written || error) {
+            std::filesystem::remove(temporary, error);
+            m_write_failures.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    std::filesystem::path m_directory;
+    std::atomic<std::uint64_t> m_hits{0};
+    std::atomic<std::uint64_t> m_misses{0};
+    std::atomic<std::uint64_t> m_rejected{0};
+    std::atomic<std::uint64_t> m_write_failures{0};
+};
+}
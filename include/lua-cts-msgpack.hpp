@@ -0,0 +1,567 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <lua-cts.hpp>
+
+namespace lua {
+// Outcome of encoding or decoding MessagePack. `offset` is the position in the input where decoding failed, `got` is
+// the Lua type which couldn't be encoded.
+struct MessagePackResult {
+    enum class Code {
+        None,
+        // Functions, userdata and threads can't be encoded, MessagePack extension types can't be decoded.
+        UnsupportedType,
+        // Tables are nested deeper than the limit.
+        TooDeep,
+        // A table contains itself.
+        Cycle,
+        // A string or table has more than 2^32 - 1 bytes or entries.
+        TooLarge,
+        Truncated,
+        // Reserved bytes, nil or NaN map keys, and bytes after the value.
+        InvalidData,
+        // lua_checkstack failed.
+        OutOfStack,
+    };
+
+    Code code = Code::None;
+    std::size_t offset = 0;
+    int got = LUA_TNONE;
+
+    explicit operator bool() const
+    {
+        return code == Code::None;
+    }
+
+    [[nodiscard]] const char* message() const
+    {
+        switch (code) {
+        case Code::None:
+            return "no error";
+        case Code::UnsupportedType:
+            return "unsupported type";
+        case Code::TooDeep:
+            return "tables nested too deep";
+        case Code::Cycle:
+            return "table contains itself";
+        case Code::TooLarge:
+            return "value too large";
+        case Code::Truncated:
+            return "truncated data";
+        case Code::InvalidData:
+            return "invalid data";
+        case Code::OutOfStack:
+            return "stack overflow";
+        }
+        return "unknown error";
+    }
+};
+
+// Converts between Lua values and MessagePack without going through C++ containers. Tables whose keys are exactly 1 to
+// #t become arrays, other tables become maps. Metamethods are ignored. The wrapper's tomsgpack and pushmsgpack use it,
+// but it also works on a plain lua_State.
+class MessagePack {
+public:
+    // How many tables can be nested inside each other.
+    constexpr static int default_max_depth = 32;
+
+    // Appends the value at `index` to `sink`, which is a std::string, a std::vector<char>, a std::vector<unsigned char>
+    // or a callable taking std::string_view pieces. On failure, the sink may have received part of the value.
+    template <typename Sink>
+    static MessagePackResult encode(lua_State* state, int index, Sink& sink, int max_depth = default_max_depth)
+    {
+        auto encoder = Encoder<Sink>(state, sink, max_depth);
+        encoder.value(lua_absindex(state, index), 0);
+        encoder.flush();
+        return encoder.result;
+    }
+
+    // Decodes a single value, which must span all of `bytes`, and pushes it. Nothing is pushed on failure. Tables are
+    // created with their final size.
+    static MessagePackResult decode(lua_State* state, std::string_view bytes, int max_depth = default_max_depth)
+    {
+        auto top = lua_gettop(state);
+        auto decoder = Decoder{state, reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size(), 0, max_depth, {}};
+        if (!lua_checkstack(state, 1)) {
+            decoder.fail(MessagePackResult::Code::OutOfStack);
+        } else if (decoder.value(0) && decoder.position != bytes.size()) {
+            decoder.fail(MessagePackResult::Code::InvalidData);
+        }
+        if (!decoder.result) {
+            lua_settop(state, top);
+        }
+        return decoder.result;
+    }
+
+private:
+    template <typename Sink>
+    class Encoder {
+    public:
+        Encoder(lua_State* state, Sink& sink, int max_depth)
+            : m_state(state)
+            , m_sink(sink)
+            , m_max_depth(max_depth)
+        {
+        }
+
+        bool value(int index, int depth)
+        {
+            switch (lua_type(m_state, index)) {
+            case LUA_TNIL:
+                put(0xc0);
+                return true;
+            case LUA_TBOOLEAN:
+                put(lua_toboolean(m_state, index) ? 0xc3 : 0xc2);
+                return true;
+            case LUA_TNUMBER:
+                if (lua_isinteger(m_state, index)) {
+                    integer(lua_tointeger(m_state, index));
+                } else {
+                    number(lua_tonumber(m_state, index));
+                }
+                return true;
+            case LUA_TSTRING: {
+                auto size = std::size_t{0};
+                auto data = lua_tolstring(m_state, index, &size);
+                if (size <= 31) {
+                    put(static_cast<unsigned char>(0xa0 | size));
+                } else if (!length(size, 0xd9, 0xda, 0xdb)) {
+                    return false;
+                }
+                write(data, size);
+                return true;
+            }
+            case LUA_TTABLE:
+                return table(index, depth + 1);
+            default:
+                result.got = lua_type(m_state, index);
+                return fail(MessagePackResult::Code::UnsupportedType);
+            }
+        }
+
+        void flush()
+        {
+            if constexpr (!is_buffer) {
+                if (m_used != 0) {
+                    m_sink(std::string_view(m_buffer.data(), m_used));
+                    m_used = 0;
+                }
+            }
+        }
+
+        MessagePackResult result;
+
+    private:
+        constexpr static bool is_buffer = std::is_same_v<Sink, std::string> || std::is_same_v<Sink, std::vector<char>>
+            || std::is_same_v<Sink, std::vector<unsigned char>>;
+
+        bool fail(MessagePackResult::Code code)
+        {
+            result.code = code;
+            return false;
+        }
+
+        bool table(int index, int depth)
+        {
+            if (depth > m_max_depth) {
+                return fail(MessagePackResult::Code::TooDeep);
+            }
+            auto pointer = lua_topointer(m_state, index);
+            if (std::find(m_path.begin(), m_path.end(), pointer) != m_path.end()) {
+                return fail(MessagePackResult::Code::Cycle);
+            }
+            if (!lua_checkstack(m_state, 3)) {
+                return fail(MessagePackResult::Code::OutOfStack);
+            }
+
+            // A sequence needs exactly the keys 1 to #t, that's the case when every key is in that range and there
+            // are #t of them.
+            auto size = static_cast<lua_Unsigned>(lua_rawlen(m_state, index));
+            auto count = lua_Unsigned{0};
+            auto sequence = true;
+            lua_pushnil(m_state);
+            while (lua_next(m_state, index)) {
+                count++;
+                if (sequence) {
+                    auto key = lua_isinteger(m_state, -2) ? lua_tointeger(m_state, -2) : 0;
+                    sequence = key >= 1 && static_cast<lua_Unsigned>(key) <= size;
+                }
+                lua_pop(m_state, 1);
+            }
+
+            m_path.push_back(pointer);
+            auto ok = sequence && count == size ? array(index, size, depth) : map(index, count, depth);
+            m_path.pop_back();
+            return ok;
+        }
+
+        bool array(int index, lua_Unsigned size, int depth)
+        {
+            if (size <= 15) {
+                put(static_cast<unsigned char>(0x90 | size));
+            } else if (!length(size, 0, 0xdc, 0xdd)) {
+                return false;
+            }
+            for (auto i = lua_Unsigned{1}; i <= size; i++) {
+                lua_rawgeti(m_state, index, static_cast<lua_Integer>(i));
+                auto ok = value(lua_gettop(m_state), depth);
+                lua_pop(m_state, 1);
+                if (!ok) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool map(int index, lua_Unsigned count, int depth)
+        {
+            if (count <= 15) {
+                put(static_cast<unsigned char>(0x80 | count));
+            } else if (!length(count, 0, 0xde, 0xdf)) {
+                return false;
+            }
+            lua_pushnil(m_state);
+            while (lua_next(m_state, index)) {
+                auto top = lua_gettop(m_state);
+                if (!value(top - 1, depth) || !value(top, depth)) {
+                    lua_pop(m_state, 2);
+                    return false;
+                }
+                lua_pop(m_state, 1);
+            }
+            return true;
+        }
+
+        // Writes the length with the shortest of the given prefixes, 0 means the 8 bit variant doesn't exist.
+        bool length(lua_Unsigned size, unsigned char prefix8, unsigned char prefix16, unsigned char prefix32)
+        {
+            if (prefix8 != 0 && size <= 0xff) {
+                big_endian(prefix8, static_cast<std::uint8_t>(size));
+            } else if (size <= 0xffff) {
+                big_endian(prefix16, static_cast<std::uint16_t>(size));
+            } else if (size <= 0xffffffff) {
+                big_endian(prefix32, static_cast<std::uint32_t>(size));
+            } else {
+                return fail(MessagePackResult::Code::TooLarge);
+            }
+            return true;
+        }
+
+        void integer(lua_Integer x)
+        {
+            if (x >= 0) {
+                if (x <= 0x7f) {
+                    put(static_cast<unsigned char>(x));
+                } else if (x <= 0xff) {
+                    big_endian(0xcc, static_cast<std::uint8_t>(x));
+                } else if (x <= 0xffff) {
+                    big_endian(0xcd, static_cast<std::uint16_t>(x));
+                } else if (x <= 0xffffffff) {
+                    big_endian(0xce, static_cast<std::uint32_t>(x));
+                } else {
+                    big_endian(0xcf, static_cast<std::uint64_t>(x));
+                }
+            } else if (x >= -32) {
+                put(static_cast<unsigned char>(x));
+            } else if (x >= INT8_MIN) {
+                big_endian(0xd0, static_cast<std::uint8_t>(x));
+            } else if (x >= INT16_MIN) {
+                big_endian(0xd1, static_cast<std::uint16_t>(x));
+            } else if (x >= INT32_MIN) {
+                big_endian(0xd2, static_cast<std::uint32_t>(x));
+            } else {
+                big_endian(0xd3, static_cast<std::uint64_t>(x));
+            }
+        }
+
+        void number(lua_Number x)
+        {
+            if constexpr (sizeof(lua_Number) == sizeof(float)) {
+                auto bits = std::uint32_t{};
+                std::memcpy(&bits, &x, sizeof(bits));
+                big_endian(0xca, bits);
+            } else {
+                auto value = static_cast<double>(x);
+                auto bits = std::uint64_t{};
+                std::memcpy(&bits, &value, sizeof(bits));
+                big_endian(0xcb, bits);
+            }
+        }
+
+        template <typename U>
+        void big_endian(unsigned char prefix, U value)
+        {
+            char bytes[sizeof(U) + 1];
+            bytes[0] = static_cast<char>(prefix);
+            for (auto i = std::size_t{0}; i < sizeof(U); i++) {
+                bytes[i + 1] = static_cast<char>(static_cast<std::uint64_t>(value) >> (8 * (sizeof(U) - 1 - i)));
+            }
+            write(bytes, sizeof(bytes));
+        }
+
+        void put(unsigned char byte)
+        {
+            auto c = static_cast<char>(byte);
+            write(&c, 1);
+        }
+
+        // Callable sinks get the output in pieces of up to the buffer's size, strings longer than that are passed
+        // without copying them.
+        void write(const char* data, std::size_t size)
+        {
+            if constexpr (is_buffer) {
+                m_sink.insert(m_sink.end(), data, data + size);
+            } else {
+                if (m_used + size > m_buffer.size()) {
+                    flush();
+                    if (size > m_buffer.size()) {
+                        m_sink(std::string_view(data, size));
+                        return;
+                    }
+                }
+                std::memcpy(m_buffer.data() + m_used, data, size);
+                m_used += size;
+            }
+        }
+
+        lua_State* m_state;
+        Sink& m_sink;
+        int m_max_depth;
+        // The tables being encoded, from the outermost one.
+        std::vector<const void*> m_path;
+        std::array<char, is_buffer ? 1 : 512> m_buffer{};
+        std::size_t m_used = 0;
+    };
+
+    struct Decoder {
+        lua_State* state;
+        const unsigned char* data;
+        std::size_t size;
+        std::size_t position;
+        int max_depth;
+        MessagePackResult result;
+
+        bool fail(MessagePackResult::Code code)
+        {
+            result.code = code;
+            result.offset = position;
+            return false;
+        }
+
+        template <typename U>
+        bool read(U& out)
+        {
+            if (size - position < sizeof(U)) {
+                return fail(MessagePackResult::Code::Truncated);
+            }
+            auto value = std::uint64_t{0};
+            for (auto i = std::size_t{0}; i < sizeof(U); i++) {
+                value = (value << 8) | data[position + i];
+            }
+            out = static_cast<U>(value);
+            position += sizeof(U);
+            return true;
+        }
+
+        template <typename U>
+        bool string()
+        {
+            auto length = U{};
+            return read(length) && string(length);
+        }
+
+        bool string(std::size_t length)
+        {
+            if (size - position < length) {
+                return fail(MessagePackResult::Code::Truncated);
+            }
+            lua_pushlstring(state, reinterpret_cast<const char*>(data + position), length);
+            position += length;
+            return true;
+        }
+
+        template <typename U, typename Signed>
+        bool integer()
+        {
+            auto value = U{};
+            if (!read(value)) {
+                return false;
+            }
+            lua_pushinteger(state, static_cast<lua_Integer>(static_cast<Signed>(value)));
+            return true;
+        }
+
+        bool value(int depth)
+        {
+            if (position == size) {
+                return fail(MessagePackResult::Code::Truncated);
+            }
+            auto byte = data[position++];
+            if (byte <= 0x7f) {
+                lua_pushinteger(state, byte);
+                return true;
+            }
+            if (byte >= 0xe0) {
+                lua_pushinteger(state, static_cast<std::int8_t>(byte));
+                return true;
+            }
+            if (byte <= 0x8f) {
+                return map(byte & 0x0f, depth + 1);
+            }
+            if (byte <= 0x9f) {
+                return array(byte & 0x0f, depth + 1);
+            }
+            if (byte <= 0xbf) {
+                return string(byte & 0x1f);
+            }
+
+            switch (byte) {
+            case 0xc0:
+                lua_pushnil(state);
+                return true;
+            case 0xc2:
+            case 0xc3:
+                lua_pushboolean(state, byte == 0xc3);
+                return true;
+            case 0xc4:
+            case 0xd9:
+                return string<std::uint8_t>();
+            case 0xc5:
+            case 0xda:
+                return string<std::uint16_t>();
+            case 0xc6:
+            case 0xdb:
+                return string<std::uint32_t>();
+            case 0xca: {
+                auto bits = std::uint32_t{};
+                auto x = float{};
+                if (!read(bits)) {
+                    return false;
+                }
+                std::memcpy(&x, &bits, sizeof(x));
+                lua_pushnumber(state, static_cast<lua_Number>(x));
+                return true;
+            }
+            case 0xcb: {
+                auto bits = std::uint64_t{};
+                auto x = double{};
+                if (!read(bits)) {
+                    return false;
+                }
+                std::memcpy(&x, &bits, sizeof(x));
+                lua_pushnumber(state, static_cast<lua_Number>(x));
+                return true;
+            }
+            case 0xcc:
+                return integer<std::uint8_t, std::uint8_t>();
+            case 0xcd:
+                return integer<std::uint16_t, std::uint16_t>();
+            case 0xce:
+                return integer<std::uint32_t, std::uint32_t>();
+            case 0xcf: {
+                // Lua integers are signed, larger values become floats.
+                auto x = std::uint64_t{};
+                if (!read(x)) {
+                    return false;
+                }
+                if (x > static_cast<std::uint64_t>(LUA_MAXINTEGER)) {
+                    lua_pushnumber(state, static_cast<lua_Number>(x));
+                } else {
+                    lua_pushinteger(state, static_cast<lua_Integer>(x));
+                }
+                return true;
+            }
+            case 0xd0:
+                return integer<std::uint8_t, std::int8_t>();
+            case 0xd1:
+                return integer<std::uint16_t, std::int16_t>();
+            case 0xd2:
+                return integer<std::uint32_t, std::int32_t>();
+            case 0xd3:
+                return integer<std::uint64_t, std::int64_t>();
+            case 0xdc:
+                return container<std::uint16_t>(&Decoder::array, depth + 1);
+            case 0xdd:
+                return container<std::uint32_t>(&Decoder::array, depth + 1);
+            case 0xde:
+                return container<std::uint16_t>(&Decoder::map, depth + 1);
+            case 0xdf:
+                return container<std::uint32_t>(&Decoder::map, depth + 1);
+            case 0xc1:
+                position--;
+                return fail(MessagePackResult::Code::InvalidData);
+            default:
+                position--;
+                return fail(MessagePackResult::Code::UnsupportedType);
+            }
+        }
+
+        template <typename U>
+        bool container(bool (Decoder::*decode)(std::size_t, int), int depth)
+        {
+            auto count = U{};
+            return read(count) && (this->*decode)(count, depth);
+        }
+
+        // Every element takes at least one byte, so counts larger than the rest of the input are rejected before any
+        // memory is allocated for them.
+        bool array(std::size_t count, int depth)
+        {
+            if (depth > max_depth) {
+                return fail(MessagePackResult::Code::TooDeep);
+            }
+            if (count > size - position) {
+                return fail(MessagePackResult::Code::Truncated);
+            }
+            if (!lua_checkstack(state, 2)) {
+                return fail(MessagePackResult::Code::OutOfStack);
+            }
+            lua_createtable(state, static_cast<int>(std::min<std::size_t>(count, INT32_MAX)), 0);
+            for (auto i = std::size_t{1}; i <= count; i++) {
+                if (!value(depth)) {
+                    return false;
+                }
+                lua_rawseti(state, -2, static_cast<lua_Integer>(i));
+            }
+            return true;
+        }
+
+        bool map(std::size_t count, int depth)
+        {
+            if (depth > max_depth) {
+                return fail(MessagePackResult::Code::TooDeep);
+            }
+            if (count > (size - position) / 2) {
+                return fail(MessagePackResult::Code::Truncated);
+            }
+            if (!lua_checkstack(state, 3)) {
+                return fail(MessagePackResult::Code::OutOfStack);
+            }
+            lua_createtable(state, 0, static_cast<int>(std::min<std::size_t>(count, INT32_MAX)));
+            for (auto i = std::size_t{0}; i < count; i++) {
+                auto key = position;
+                if (!value(depth)) {
+                    return false;
+                }
+                if (lua_isnil(state, -1) || (lua_type(state, -1) == LUA_TNUMBER && lua_tonumber(state, -1) != lua_tonumber(state, -1))) {
+                    position = key;
+                    return fail(MessagePackResult::Code::InvalidData);
+                }
+                if (!value(depth)) {
+                    return false;
+                }
+                lua_rawset(state, -3);
+            }
+            return true;
+        }
+    };
+};
+}
@@ -0,0 +1,290 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <lua-cts.hpp>
+
+namespace lua {
+// Snapshot of one worker of a lua::StatePool.
+struct WorkerStats {
+    constexpr static std::size_t latency_buckets = 32;
+
+    // Tasks waiting in the worker's own queue.
+    std::size_t queue_depth = 0;
+    std::uint64_t executed = 0;
+    // Tasks taken from the queue of another worker.
+    std::uint64_t stolen = 0;
+    // Tasks which threw an exception.
+    std::uint64_t failed = 0;
+    // Time from submitting a task to it finishing. latency[i] counts the tasks which took less than 2^i microseconds (and
+    // at least 2^(i - 1)), the last bucket also counts everything slower.
+    std::array<std::uint64_t, latency_buckets> latency{};
+};
+
+// A fixed set of independent lua_States, each owned by its own worker thread. Every state is prepared by the same
+// `setup` function (which loads the shared chunks and bindings) before it runs any task, so a task can run on any of
+// them. Tasks are spread over the workers' queues, and idle workers steal tasks from the other queues:
+// auto pool = lua::StatePool(std::thread::hardware_concurrency(), [] (lua_State* state) { load_scripts(state); });
+// pool.submit([] (lua_State* state) {
+//     lua::StackWrapper<>(state)...
+// });
+// Tasks start with an empty stack, whatever they leave on it is removed.
+class StatePool {
+public:
+    using Task = std::function<void(lua_State*)>;
+    using Setup = std::function<void(lua_State*)>;
+    // Creates the states, for example with a custom allocator.
+    using Factory = std::function<lua_State*()>;
+
+    StatePool(std::size_t size, Setup setup, Factory factory = &luaL_newstate)
+    {
+        if (size == 0) {
+            throw std::invalid_argument("A state pool needs at least one state");
+        }
+        m_workers.reserve(size);
+        for (auto i = std::size_t{0}; i < size; i++) {
+            m_workers.push_back(std::make_unique<Worker>());
+        }
+
+        // Each state is created and prepared on its own thread. The constructor waits for all of them, so a state whose
+        // setup throws doesn't leave the pool half-built without anyone noticing.
+        auto ready = std::size_t{0};
+        auto error = std::exception_ptr{};
+        auto ready_mutex = std::mutex{};
+        auto ready_cv = std::condition_variable{};
+        auto started = std::size_t{0};
+        auto wait_ready = [&ready, &ready_mutex, &ready_cv, &started] {
+            auto lock = std::unique_lock(ready_mutex);
+            ready_cv.wait(lock, [&ready, &started] { return ready == started; });
+        };
+        try {
+            for (; started < size; started++) {
+                m_workers[started]->thread = std::thread([this, i = started, &setup, &factory, &ready, &error, &ready_mutex, &ready_cv] {
+                    auto state = std::unique_ptr<lua_State, decltype(&lua_close)>(nullptr, lua_close);
+                    try {
+                        state.reset(factory());
+                        if (!state) {
+                            throw std::bad_alloc();
+                        }
+                        setup(state.get());
+                        lua_settop(state.get(), 0);
+                    } catch (...) {
+                        auto lock = std::lock_guard(ready_mutex);
+                        if (!error) {
+                            error = std::current_exception();
+                        }
+                        state.reset();
+                    }
+                    {
+                        // Notified under the lock, the constructor may return (destroying ready_cv) as soon as it's
+                        // released.
+                        auto lock = std::lock_guard(ready_mutex);
+                        ready++;
+                        ready_cv.notify_one();
+                    }
+                    if (state) {
+                        work(i, state.get());
+                    }
+                });
+            }
+        } catch (...) {
+            // The workers which did start still use the locals above, so they have to be done with them first.
+            wait_ready();
+            stop();
+            throw;
+        }
+
+        wait_ready();
+        if (error) {
+            stop();
+            std::rethrow_exception(error);
+        }
+    }
+
+    StatePool(const StatePool&) = delete;
+    StatePool& operator=(const StatePool&) = delete;
+
+    // Runs the tasks which are still queued, then closes the states.
+    ~StatePool()
+    {
+        stop();
+    }
+
+    void submit(Task task)
+    {
+        auto& worker = *m_workers[m_next_worker++ % m_workers.size()];
+        // Counted before it's queued, so a worker can't finish the task before it's counted.
+        m_unfinished++;
+        m_pending++;
+        {
+            auto lock = std::lock_guard(worker.mutex);
+            worker.queue.push_back(Job{std::move(task), Clock::now()});
+        }
+        // Only sleeping workers need to be woken up. Workers count themselves as sleeping before checking for pending
+        // tasks, so either they see this task, or this sees them.
+        if (m_sleeping > 0) {
+            auto lock = std::lock_guard(m_mutex);
+        }
+        m_work_cv.notify_one();
+    }
+
+    // Waits until every submitted task has finished.
+    void wait_idle()
+    {
+        auto lock = std::unique_lock(m_mutex);
+        m_idle_cv.wait(lock, [this] { return m_unfinished == 0; });
+    }
+
+    [[nodiscard]] std::size_t size() const
+    {
+        return m_workers.size();
+    }
+
+    [[nodiscard]] std::vector<WorkerStats> stats() const
+    {
+        auto result = std::vector<WorkerStats>(m_workers.size());
+        for (auto i = std::size_t{0}; i < m_workers.size(); i++) {
+            const auto& worker = *m_workers[i];
+            {
+                auto lock = std::lock_guard(worker.mutex);
+                result[i].queue_depth = worker.queue.size();
+            }
+            result[i].executed = worker.executed.load(std::memory_order_relaxed);
+            result[i].stolen = worker.stolen.load(std::memory_order_relaxed);
+            result[i].failed = worker.failed.load(std::memory_order_relaxed);
+            for (auto bucket = std::size_t{0}; bucket < WorkerStats::latency_buckets; bucket++) {
+                result[i].latency[bucket] = worker.latency[bucket].load(std::memory_order_relaxed);
+            }
+        }
+        return result;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Job {
+        Task task;
+        Clock::time_point submitted;
+    };
+
+    struct Worker {
+        std::thread thread;
+        mutable std::mutex mutex;
+        std::deque<Job> queue;
+        std::atomic<std::uint64_t> executed{0};
+        std::atomic<std::uint64_t> stolen{0};
+        std::atomic<std::uint64_t> failed{0};
+        std::array<std::atomic<std::uint64_t>, WorkerStats::latency_buckets> latency{};
+    };
+
+    static std::size_t latency_bucket(Clock::duration latency)
+    {
+        auto micros = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+        auto bucket = std::size_t{0};
+        while (micros != 0 && bucket + 1 < WorkerStats::latency_buckets) {
+            micros >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+    // Takes the oldest task of the worker's own queue, or steals one from the queues of the other workers.
+    bool take(std::size_t self, Job& job)
+    {
+        {
+            auto& worker = *m_workers[self];
+            auto lock = std::lock_guard(worker.mutex);
+            if (!worker.queue.empty()) {
+                job = std::move(worker.queue.front());
+                worker.queue.pop_front();
+                return true;
+            }
+        }
+
+        for (auto offset = std::size_t{1}; offset < m_workers.size(); offset++) {
+            auto& victim = *m_workers[(self + offset) % m_workers.size()];
+            auto lock = std::lock_guard(victim.mutex);
+            if (!victim.queue.empty()) {
+                job = std::move(victim.queue.front());
+                victim.queue.pop_front();
+                m_workers[self]->stolen.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(std::size_t self, lua_State* state)
+    {
+        auto& worker = *m_workers[self];
+        while (true) {
+            auto job = Job{};
+            if (!take(self, job)) {
+                auto lock = std::unique_lock(m_mutex);
+                m_sleeping++;
+                m_work_cv.wait(lock, [this] { return m_stopping || m_pending > 0; });
+                m_sleeping--;
+                if (m_stopping && m_pending <= 0) {
+                    return;
+                }
+                continue;
+            }
+
+            m_pending--;
+            try {
+                job.task(state);
+            } catch (...) {
+                worker.failed.fetch_add(1, std::memory_order_relaxed);
+            }
+            lua_settop(state, 0);
+            worker.latency[latency_bucket(Clock::now() - job.submitted)].fetch_add(1, std::memory_order_relaxed);
+            worker.executed.fetch_add(1, std::memory_order_relaxed);
+
+            if (--m_unfinished == 0) {
+                {
+                    auto lock = std::lock_guard(m_mutex);
+                }
+                m_idle_cv.notify_all();
+            }
+        }
+    }
+
+    void stop()
+    {
+        {
+            auto lock = std::lock_guard(m_mutex);
+            m_stopping = true;
+        }
+        m_work_cv.notify_all();
+        for (auto& worker : m_workers) {
+            if (worker->thread.joinable()) {
+                worker->thread.join();
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<std::size_t> m_next_worker{0};
+    std::mutex m_mutex;
+    std::condition_variable m_work_cv;
+    std::condition_variable m_idle_cv;
+    // Tasks which are submitted but weren't taken by a worker yet, tasks which didn't finish yet, and workers waiting for
+    // tasks.
+    std::atomic<std::ptrdiff_t> m_pending{0};
+    std::atomic<std::size_t> m_unfinished{0};
+    std::atomic<int> m_sleeping{0};
+    bool m_stopping = false;
+};
+}
@@ -0,0 +1,269 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <lua-cts.hpp>
+
+namespace lua {
+// Runs many coroutines ("tasks") of one lua_State cooperatively on the calling thread. Tasks run until they yield, and
+// are then parked until whatever they are waiting for happens:
+// - scheduler.yield() puts the task at the back of the run queue
+// - scheduler.sleep(seconds) parks it until a timer expires. Seconds must be finite and non-negative.
+// - scheduler.wait(event) parks it until the host calls notify(event, values...), wait() then returns the values
+// Tasks are resumed through typed stack windows: a new task through a window of its function, a notified one through a
+// window of the values passed to notify(), and any other one through an empty window.
+// The scheduler never reads a clock itself, the host passes the current time to run(). That makes timers (and events,
+// which are just integers chosen by the host) easy to drive from tests.
+class Scheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+    using TimePoint = Clock::time_point;
+    using TaskId = std::size_t;
+    // Called with the task and the error message when a task raises an error.
+    using ErrorHandler = std::function<void(TaskId, std::string_view)>;
+
+    enum class TaskState {
+        Ready,
+        Sleeping,
+        Waiting,
+        Finished,
+    };
+
+    explicit Scheduler(ErrorHandler on_error = {})
+        : m_on_error(std::move(on_error))
+    {
+    }
+
+    // The library functions point to the scheduler.
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // Pushes a table with the sleep, wait and yield functions. They must only be called from tasks of this scheduler,
+    // and the scheduler must outlive the table.
+    template <typename SW>
+    [[nodiscard]] auto pushlibrary(SW s)
+    {
+        return s.createtable(0, 3)
+            .pushlightuserdata(this).template pushcclosure<1>(&sleep_function).template setfield<-2>("sleep")
+            .pushlightuserdata(this).template pushcclosure<1>(&wait_function).template setfield<-2>("wait")
+            .pushlightuserdata(this).template pushcclosure<1>(&yield_function).template setfield<-2>("yield");
+    }
+
+    // Pops the function on the top of the stack and makes it a new task, which starts on the next run. The function
+    // runs on a new coroutine, which is kept alive by a registry reference until the task finishes.
+    template <typename SW>
+    [[nodiscard]] auto spawn(SW s, TaskId& id)
+    {
+        static_assert(std::is_same_v<select_type_t<SW, SW::stack_size>, Function>, "The value on the top of the stack is not a function.");
+        auto task = Task{};
+        auto s2 = s.newthread().template tothread<-1>([&task] (lua_State* thread) { task.thread = thread; }).ref(task.ref);
+        auto t = StackWindow<>(task.thread);
+        auto [s3, t2] = s2.template xmove<1>(t);
+        static_assert(std::is_same_v<decltype(t2), StackWindow<Function>>);
+        task.resume = &resume_task<decltype(t2), 0>;
+
+        id = m_next_id++;
+        m_tasks.emplace(id, std::move(task));
+        m_ready.push_back(id);
+        return s3;
+    }
+
+    // Wakes up every task waiting for `event`. The values are pushed onto the tasks' stacks right away, their wait()
+    // calls return them. Returns the number of tasks woken up.
+    template <typename... Args>
+    std::size_t notify(lua_Integer event, const Args&... values)
+    {
+        auto it = m_waiters.find(event);
+        if (it == m_waiters.end()) {
+            return 0;
+        }
+
+        auto waiters = std::move(it->second);
+        m_waiters.erase(it);
+        for (auto id : waiters) {
+            auto& task = m_tasks.at(id);
+            (Value<Args>::push(task.thread, values), ...);
+            task.resume = &resume_task<StackWindow<typename Value<Args>::type...>, int{sizeof...(Args)}>;
+            task.state = TaskState::Ready;
+            m_ready.push_back(id);
+        }
+        return waiters.size();
+    }
+
+    // Wakes up the tasks whose timers expired at `now`, then resumes every ready task once. Tasks which become ready
+    // during the run (because they yielded, or were spawned or notified) are resumed on the next run. Returns the number
+    // of tasks resumed.
+    std::size_t run(TimePoint now)
+    {
+        m_now = now;
+        while (!m_timers.empty() && m_timers.top().first <= now) {
+            auto id = m_timers.top().second;
+            m_timers.pop();
+            m_tasks.at(id).state = TaskState::Ready;
+            m_ready.push_back(id);
+        }
+
+        auto count = m_ready.size();
+        for (auto i = std::size_t{0}; i < count; i++) {
+            auto id = m_ready.front();
+            m_ready.pop_front();
+            auto& task = m_tasks.at(id);
+            task.resume(*this, id, task);
+        }
+        return count;
+    }
+
+    // When the earliest timer expires, nothing if no task is sleeping.
+    [[nodiscard]] std::optional<TimePoint> next_deadline() const
+    {
+        if (m_timers.empty()) {
+            return std::nullopt;
+        }
+        return m_timers.top().first;
+    }
+
+    [[nodiscard]] bool has_ready_tasks() const
+    {
+        return !m_ready.empty();
+    }
+
+    // Tasks which haven't finished yet.
+    [[nodiscard]] std::size_t task_count() const
+    {
+        return m_tasks.size();
+    }
+
+    [[nodiscard]] TaskState state(TaskId id) const
+    {
+        auto it = m_tasks.find(id);
+        return it == m_tasks.end() ? TaskState::Finished : it->second.state;
+    }
+
+private:
+    struct Task;
+    // Resumes a task. Instantiated for the values the task is resumed with, see resume_task.
+    using Resume = void (*)(Scheduler&, TaskId, Task&);
+
+    struct Task {
+        lua_State* thread = nullptr;
+        Ref<Thread> ref;
+        TaskState state = TaskState::Ready;
+        // How the task continues: started with its function, or resumed with the values on the top of its stack.
+        Resume resume = nullptr;
+    };
+
+    using Timer = std::pair<TimePoint, TaskId>;
+
+    // Longer sleeps are cut to this (about a century), so the deadline can't overflow the clock's range.
+    constexpr static lua_Number max_sleep_seconds = 100.0 * 365 * 24 * 60 * 60;
+
+    // `Window` is what the task's stack holds on top of its suspended frames, NArgs of them are passed to the coroutine.
+    // The window is checked when the task is resumed, so values pushed behind the scheduler's back are caught.
+    template <typename Window, int NArgs>
+    static void resume_task(Scheduler& self, TaskId id, Task& task)
+    {
+        self.m_current = &task;
+        self.m_current_id = id;
+        auto finished = Window(task.thread).template resume<NArgs>(nullptr, [] (auto) {
+            return true;
+        }, [&self, id, &task] (auto yielded) {
+            // Tasks yield through the library functions, which don't pass any values. Anything else is dropped.
+            (void)yielded.drop();
+            task.resume = &resume_task<StackWindow<>, 0>;
+            if (task.state == TaskState::Ready) {
+                self.m_ready.push_back(id);
+            }
+            return false;
+        }, [&self, id] (auto error) {
+            if (self.m_on_error) {
+                error.template visit<1>([&self, id] (StackWindow<String> error) {
+                    (void)error.tolstring<1>([&self, id] (std::string_view message) { self.m_on_error(id, message); });
+                }, [&self, id] (auto) {
+                    self.m_on_error(id, "error object is not a string");
+                });
+            }
+            return true;
+        });
+        self.m_current = nullptr;
+        if (finished) {
+            self.m_tasks.erase(id);
+        }
+    }
+
+    // The scheduler of a library function, which fails if it isn't called from one of its tasks.
+    static Scheduler& current(lua_State* state)
+    {
+        auto& self = *static_cast<Scheduler*>(lua_touserdata(state, lua_upvalueindex(1)));
+        if (!self.m_current || self.m_current->thread != state) {
+            luaL_error(state, "only tasks of this scheduler can yield to it");
+        }
+        return self;
+    }
+
+    // Runs `f`, turning C++ exceptions (allocation failures of the containers) into Lua errors. The library functions
+    // are called from Lua, which unwinds with longjmp, so exceptions must not leave them.
+    template <typename F>
+    static void protect(lua_State* state, F&& f)
+    {
+        auto failed = false;
+        try {
+            f();
+        } catch (...) {
+            failed = true;
+        }
+        if (failed) {
+            luaL_error(state, "not enough memory");
+        }
+    }
+
+    static int sleep_function(lua_State* state)
+    {
+        auto& self = current(state);
+        auto seconds = lua_Number{0};
+        auto s = with_policy<LuaErrorPolicy>::StackWrapper<Number>(state).tonumber<1>([&seconds] (lua_Number x) { seconds = x; });
+        if (!std::isfinite(seconds) || seconds < 0) {
+            luaL_argerror(state, 1, "expected a finite, non-negative number of seconds");
+        }
+        auto duration = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<lua_Number>(std::min(seconds, max_sleep_seconds)));
+        protect(state, [&self, duration] { self.m_timers.emplace(self.m_now + duration, self.m_current_id); });
+        self.m_current->state = TaskState::Sleeping;
+        return s.pop<1>().yield<0>();
+    }
+
+    static int wait_function(lua_State* state)
+    {
+        auto& self = current(state);
+        auto event = lua_Integer{0};
+        auto s = with_policy<LuaErrorPolicy>::StackWrapper<Integer>(state).tointeger<1>([&event] (lua_Integer x) { event = x; });
+        protect(state, [&self, event] { self.m_waiters[event].push_back(self.m_current_id); });
+        self.m_current->state = TaskState::Waiting;
+        return s.pop<1>().yield<0>();
+    }
+
+    static int yield_function(lua_State* state)
+    {
+        current(state);
+        return with_policy<LuaErrorPolicy>::StackWrapper<>(state).yield<0>();
+    }
+
+    ErrorHandler m_on_error;
+    std::unordered_map<TaskId, Task> m_tasks;
+    std::deque<TaskId> m_ready;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> m_timers;
+    std::unordered_map<lua_Integer, std::vector<TaskId>> m_waiters;
+    TimePoint m_now;
+    Task* m_current = nullptr;
+    TaskId m_current_id = 0;
+    TaskId m_next_id = 1;
+};
+}
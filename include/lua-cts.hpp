@@ -1,5 +1,23 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <new>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 #include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <lua.hpp>
 
 namespace lua {
@@ -7,6 +25,34 @@ struct Number {
     constexpr static int value = LUA_TNUMBER;
     constexpr static auto name = "a number";
 };
+// Lua keeps track of whether a number is an integer or a float. Both can be used wherever a Number is expected.
+struct Integer : Number {
+    constexpr static auto name = "an integer";
+};
+struct Float : Number {
+    constexpr static auto name = "a float";
+};
+struct Boolean {
+    constexpr static int value = LUA_TBOOLEAN;
+    constexpr static auto name = "a boolean";
+};
+struct LightUserdata {
+    constexpr static int value = LUA_TLIGHTUSERDATA;
+    constexpr static auto name = "a light userdata";
+};
+struct Userdata {
+    constexpr static int value = LUA_TUSERDATA;
+    constexpr static auto name = "a full userdata";
+};
+struct Thread {
+    constexpr static int value = LUA_TTHREAD;
+    constexpr static auto name = "a thread";
+};
+// A full userdata holding a T, created by pushuserdata.
+template <typename T>
+struct UserdataOf : Userdata {
+    using object_type = T;
+};
 struct Nil {
     constexpr static int value = LUA_TNIL;
     constexpr static auto name = "nil";
@@ -36,18 +82,59 @@ constexpr int toAbsoluteIndex(int stack_size, int i)
     return stack_size + i + 1;
 }
 
+// Converts an index to one relative to the top of the stack. Relative indices don't depend on what's below the typed
+// part of the stack, so they work for both full stacks and windows.
+constexpr int toRelativeIndex(int stack_size, int i)
+{
+    if (i < 0) {
+        return i;
+    }
+
+    return i - stack_size - 1;
+}
+
+// The type list algorithms below all have a constant instantiation depth: they're built on index_sequence and pick
+// elements by overload resolution instead of recursing over the list. Binding code can model stacks hundreds of values
+// deep, and recursive algorithms make compile times and compiler memory blow up with that.
+template <std::size_t I, typename T>
+struct indexed_type {
+    using type = T;
+};
+
+template <typename S, typename... Args>
+struct indexed_types;
+
+template <std::size_t... Is, typename... Args>
+struct indexed_types<std::index_sequence<Is...>, Args...> : indexed_type<Is, Args>... {
+};
+
+template <std::size_t I, typename T>
+indexed_type<I, T> select_indexed(const indexed_type<I, T>&);
+
+// Zero-based.
+template <std::size_t I, typename... Args>
+using nth_type_t = typename decltype(select_indexed<I>(indexed_types<std::index_sequence_for<Args...>, Args...>{}))::type;
+
+template <typename T, std::size_t>
+struct repeat_type {
+    using type = T;
+};
+
 template <typename T, typename S>
 struct pop_back_impl;
 
 template <template <typename...> class C, typename... Args, std::size_t... Is>
 struct pop_back_impl<C<Args...>, std::index_sequence<Is...>> {
-    using type = C<std::tuple_element_t<Is, std::tuple<Args...>>...>;
+    using type = C<nth_type_t<Is, Args...>...>;
 };
 
 template <typename C, int N>
-struct pop_back {
-    static_assert(C::stack_size - N >= 0, "Can't pop more values than present on the stack");
-    using type = typename pop_back_impl<C, std::make_index_sequence<(C::stack_size) - N>>::type;
+struct pop_back;
+
+template <template <typename...> class C, typename... Args, int N>
+struct pop_back<C<Args...>, N> {
+    static_assert(int{sizeof...(Args)} - N >= 0, "Can't pop more values than present on the stack");
+    using type = typename pop_back_impl<C<Args...>, std::make_index_sequence<sizeof...(Args) - N>>::type;
 };
 
 template <typename C, int N>
@@ -69,27 +156,26 @@ struct push_types<C<Args...>, NewType...> {
 template <typename SW, typename... NewType>
 using push_type_t = typename push_types<SW, NewType...>::type;
 
-template <typename S, int N>
-struct pop_front;
-
-template <typename S, int N>
-using pop_front_t = typename pop_front<S, N>::type;
+template <typename S, typename Is, int N>
+struct pop_front_impl;
 
-template <template<typename...> typename SW, typename Arg, typename... Args, int N>
-struct pop_front<SW<Arg, Args...>, N> {
-    using type = pop_front_t<SW<Args...>, N - 1>;
+template <template <typename...> class C, typename... Args, std::size_t... Is, int N>
+struct pop_front_impl<C<Args...>, std::index_sequence<Is...>, N> {
+    using type = C<nth_type_t<N + Is, Args...>...>;
 };
 
-template <template<typename...> typename SW>
-struct pop_front<SW<>, 0> {
-    using type = SW<>;
-};
+template <typename S, int N>
+struct pop_front;
 
-template <template<typename...> typename SW, typename Arg, typename... Args>
-struct pop_front<SW<Arg, Args...>, 0> {
-    using type = SW<Arg, Args...>;
+template <template<typename...> typename SW, typename... Args, int N>
+struct pop_front<SW<Args...>, N> {
+    static_assert(N >= 0 && N <= int{sizeof...(Args)}, "Can't pop more values than present on the stack");
+    using type = typename pop_front_impl<SW<Args...>, std::make_index_sequence<sizeof...(Args) - N>, N>::type;
 };
 
+template <typename S, int N>
+using pop_front_t = typename pop_front<S, N>::type;
+
 template <typename T, typename S>
 struct concat_types;
 
@@ -101,26 +187,22 @@ struct concat_types<SW1<Args1...>, SW2<Args2...>> {
 template <typename T, typename S>
 using concat_types_t = typename concat_types<T, S>::type;
 
+template <typename SW, typename Is, int AbsoluteIndex, typename NewType>
+struct replace_type_impl;
+
+template <template <typename...> class C, typename... Args, std::size_t... Is, int AbsoluteIndex, typename NewType>
+struct replace_type_impl<C<Args...>, std::index_sequence<Is...>, AbsoluteIndex, NewType> {
+    using type = C<std::conditional_t<Is + 1 == AbsoluteIndex, NewType, nth_type_t<Is, Args...>>...>;
+};
+
 template <typename SW, int N, typename NewType>
 struct replace_type;
 
 template <template <typename...> class C, typename... Args, int N, typename NewType>
 struct replace_type<C<Args...>, N, NewType> {
     static_assert(sizeof...(Args) != 0, "Can't replace type of 0 size stack.");
-    // Example:
-    // If stack size is 2 and we want to replace the second element, N will be 2. So we first pop one element from the
-    // back.
     constexpr static auto absolute_index = toAbsoluteIndex(sizeof...(Args), N);
-    constexpr static auto args_to_pop = sizeof...(Args) - absolute_index + 1;
-    using head = pop_back_t<C<Args...>, args_to_pop>;
-    // The original stack size is 2. We we need all the elements after the to-be-replaced element.
-    // So, if the replaced element is the second one, we need to pop two from the front.
-    using tail = pop_front_t<C<Args...>, absolute_index>;
-
-    using with_replaced_element = concat_types_t<head, C<NewType>>;
-    using with_tail = concat_types_t<with_replaced_element, tail>;
-
-    using type = with_tail;
+    using type = typename replace_type_impl<C<Args...>, std::index_sequence_for<Args...>, absolute_index, NewType>::type;
 };
 
 template <typename SW, int N, typename NewType>
@@ -131,62 +213,217 @@ struct select_type;
 
 template <template <typename...> class C, typename... Args, int N>
 struct select_type<C<Args...>, N> {
-    using type = typename std::tuple_element_t<N - 1, std::tuple<Args...>>;
+    using type = nth_type_t<N - 1, Args...>;
 };
 
 template <typename T, int N>
 using select_type_t = typename select_type<T, N>::type;
 
-template <typename T, int IDX, int N>
-struct rotate;
+// Where does the element at zero-based position `i` come from after rotating the window starting at `first` (also
+// zero-based) of size `window` by `n` positions (the same way lua_rotate does).
+constexpr std::size_t rotated_index(std::size_t i, int first, int window, int n)
+{
+    if (window <= 0 || int(i) < first) {
+        return i;
+    }
 
-template <typename T, int IDX, int N>
-using rotate_t = typename rotate<T, IDX, N>::type;
+    auto shift = ((n % window) + window) % window;
+    return std::size_t(first + (int(i) - first - shift + window) % window);
+}
 
-template <template <typename...> class C, typename... Args, int IDX>
-struct rotate<C<Args...>, IDX, 0> {
-    using type = C<Args...>;
+template <typename T, typename Is, int First, int Window, int N>
+struct rotate_impl;
+
+template <template <typename...> class C, typename... Args, std::size_t... Is, int First, int Window, int N>
+struct rotate_impl<C<Args...>, std::index_sequence<Is...>, First, Window, N> {
+    using type = C<nth_type_t<rotated_index(Is, First, Window, N), Args...>...>;
 };
 
+template <typename T, int IDX, int N>
+struct rotate;
+
 template <template <typename...> class C, typename... Args, int IDX, int N>
 struct rotate<C<Args...>, IDX, N> {
+    // We're rotating <A, B, C, D>. Let's say we want to rotate C and D, so the window starts at index 3 and has two
+    // elements. The rotation is computed as a single permutation of the indices, so N is taken modulo the window size.
     constexpr static auto absolute_index = toAbsoluteIndex(sizeof...(Args), IDX);
+    constexpr static auto window = int{sizeof...(Args)} - absolute_index + 1;
+
+    using type = typename rotate_impl<C<Args...>, std::index_sequence_for<Args...>, absolute_index - 1, window, N>::type;
+};
+
+template <typename T, int IDX, int N>
+using rotate_t = typename rotate<T, IDX, N>::type;
+
+// The address of metatable_key<T> identifies the metatable of userdata holding a T in the registry. Looking it up is a
+// pointer comparison instead of hashing a metatable name.
+template <typename T>
+inline char metatable_key = 0;
+
+template <typename T>
+int destroy_userdata(lua_State* state)
+{
+    static_cast<T*>(lua_touserdata(state, 1))->~T();
+    return 0;
+}
+
+// Pushes the metatable shared by all userdata holding a T. It's created (with a __gc running T's destructor) the first
+// time it's needed in a state.
+template <typename T>
+void push_userdata_metatable(lua_State* state)
+{
+    if (lua_rawgetp(state, LUA_REGISTRYINDEX, &metatable_key<T>) != LUA_TNIL) {
+        return;
+    }
+
+    lua_pop(state, 1);
+    lua_createtable(state, 0, 1);
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+        lua_pushcfunction(state, destroy_userdata<T>);
+        lua_setfield(state, -2, "__gc");
+    }
+    lua_pushvalue(state, -1);
+    lua_rawsetp(state, LUA_REGISTRYINDEX, &metatable_key<T>);
+}
 
-    // We're rotating <A, B, C, D>
-    // Let's say we want to rotate C and D.
-    constexpr static auto args_to_pop = sizeof...(Args) - absolute_index + 1;
+template <typename T>
+bool is_userdata_of(lua_State* state, int index)
+{
+    if (lua_type(state, index) != LUA_TUSERDATA || !lua_getmetatable(state, index)) {
+        return false;
+    }
 
-    // This is the part we don't want to rotate.
-    // head = <A, B>
-    using head = pop_back_t<C<Args...>, args_to_pop>;
+    lua_rawgetp(state, LUA_REGISTRYINDEX, &metatable_key<T>);
+    auto same = lua_rawequal(state, -1, -2);
+    lua_pop(state, 2);
+    return same;
+}
 
-    // This is the part we will rotate.
-    // to_rotate = <C, D>
-    using to_rotate = pop_front_t<C<Args...>, absolute_index - 1>;
+template <typename T>
+struct is_userdata_of_type : std::false_type {
+};
 
-    // We'll take the last element, append it to the front, and then pop the last element.
-    using rotated = pop_back_t<concat_types_t<C<select_type_t<to_rotate, toAbsoluteIndex(to_rotate::stack_size, -1)>>, to_rotate>, 1>;
+template <typename T>
+struct is_userdata_of_type<UserdataOf<T>> : std::true_type {
+};
 
-    // Lastly we'll prepend the head again.
-    using rotated_with_head = concat_types_t<head, rotated>;
+template <typename Type>
+bool has_type(lua_State* state, int index)
+{
+    if constexpr (is_userdata_of_type<Type>::value) {
+        return is_userdata_of<typename Type::object_type>(state, index);
+    } else if constexpr (std::is_same_v<Type, Integer>) {
+        return lua_isinteger(state, index);
+    } else if constexpr (std::is_same_v<Type, Float>) {
+        return lua_type(state, index) == LUA_TNUMBER && !lua_isinteger(state, index);
+    } else {
+        return lua_type(state, index) == Type::value;
+    }
+}
 
-    using type = rotate_t<rotated_with_head, IDX, N - 1>;
+// Describes why the stack didn't match what the wrapper expected. It's a plain value, so reporting it never allocates.
+// Converts to true if there was an error.
+struct StackError {
+    enum class Code {
+        None,
+        // The window base is negative, `expected_size` values don't fit on a stack of `size` values.
+        NotEnoughValues,
+        // The stack has `size` values instead of `expected_size`.
+        WrongSize,
+        // The value at `index` has type `got` instead of `expected`.
+        WrongType,
+        // The number at `index` isn't an integer and can't be converted to one.
+        NoIntegerRepresentation,
+        // lua_checkstack couldn't make room for `expected_size` more values.
+        StackOverflow,
+        // A called function raised an error. The error object is on the top of the stack.
+        RuntimeError,
+    };
+
+    Code code = Code::None;
+    int expected_size = 0;
+    int size = 0;
+    int index = 0;
+    const char* expected = nullptr;
+    int got = LUA_TNONE;
+
+    explicit operator bool() const
+    {
+        return code != Code::None;
+    }
 };
 
-template <int ArgNum, typename ArgType, typename... Rest>
-void impl_check_lua_args(lua_State* state)
+// Throws a std::runtime_error describing the error. The message is only built here, so the code calling this doesn't
+// need to deal with strings.
+[[noreturn]] inline void throw_stack_error(lua_State* state, const StackError& error)
 {
-    if constexpr (!std::is_same_v<ArgType, Unknown>) {
-        if (auto type = lua_type(state, ArgNum); type != ArgType::value) {
-            using namespace std::string_literals;
-            throw std::runtime_error("Stack value #%d should have been of type "s + lua_typename(state, ArgType::value) + " (got `" + lua_typename(state, type) + ")");
-        }
+    using namespace std::string_literals;
+    switch (error.code) {
+    case StackError::Code::NotEnoughValues:
+        throw std::runtime_error("Expected at least " + std::to_string(error.expected_size) + " values on the stack (got " + std::to_string(error.size) + ")");
+    case StackError::Code::WrongSize:
+        throw std::runtime_error("Expected stack size is " + std::to_string(error.expected_size) + " (got " + std::to_string(error.size) + ")");
+    case StackError::Code::WrongType:
+        throw std::runtime_error("Stack value #"s + std::to_string(error.index) + " should have been " + error.expected + " (got `" + lua_typename(state, error.got) + ")");
+    case StackError::Code::NoIntegerRepresentation:
+        throw std::runtime_error("Stack value #" + std::to_string(error.index) + " has no integer representation");
+    case StackError::Code::StackOverflow:
+        throw std::runtime_error("Can't grow the stack by " + std::to_string(error.expected_size) + " values");
+    case StackError::Code::RuntimeError: {
+        auto message = lua_type(state, -1) == LUA_TSTRING ? std::string(lua_tostring(state, -1)) : "Error object is not a string"s;
+        lua_pop(state, 1);
+        throw std::runtime_error(message);
+    }
+    case StackError::Code::None:
+        break;
+    }
+    throw std::logic_error("throw_stack_error called without an error");
+}
+
+// Raises the error as a Lua error. luaL_error formats the message inside Lua, so nothing is allocated on the C++ heap.
+[[noreturn]] inline void raise_stack_error(lua_State* state, const StackError& error)
+{
+    switch (error.code) {
+    case StackError::Code::NotEnoughValues:
+        luaL_error(state, "expected at least %d values on the stack (got %d)", error.expected_size, error.size);
+        break;
+    case StackError::Code::WrongSize:
+        luaL_error(state, "expected stack size is %d (got %d)", error.expected_size, error.size);
+        break;
+    case StackError::Code::WrongType:
+        luaL_error(state, "stack value #%d should have been %s (got %s)", error.index, error.expected, lua_typename(state, error.got));
+        break;
+    case StackError::Code::NoIntegerRepresentation:
+        luaL_error(state, "stack value #%d has no integer representation", error.index);
+        break;
+    case StackError::Code::RuntimeError:
+        lua_error(state);
+        break;
+    case StackError::Code::StackOverflow:
+    case StackError::Code::None:
+        luaL_error(state, "can't grow the stack by %d values", error.expected_size);
+        break;
     }
+    std::abort(); // luaL_error doesn't return, but it isn't declared [[noreturn]].
+}
 
-    if constexpr (sizeof...(Rest) != 0)  {
-        impl_check_lua_args<ArgNum + 1, Rest...>(state);
+// Indices in errors are counted from the base, like the indices used with the wrapper.
+template <typename ArgType>
+bool impl_find_stack_error(lua_State* state, int base, int arg_num, StackError& error)
+{
+    if constexpr (!std::is_same_v<ArgType, Unknown>) {
+        if (!has_type<ArgType>(state, base + arg_num)) {
+            error = StackError{StackError::Code::WrongType, 0, 0, arg_num, ArgType::name, lua_type(state, base + arg_num)};
+            return false;
+        }
     }
+    return true;
+}
 
+template <typename... ArgTypes, std::size_t... Is>
+void impl_find_stack_errors(lua_State* state, int base, StackError& error, std::index_sequence<Is...>)
+{
+    (impl_find_stack_error<ArgTypes>(state, base, static_cast<int>(Is) + 1, error) && ...);
 }
 
 template <typename SW, typename What, int N>
@@ -195,28 +432,160 @@ struct append_times;
 template <typename SW, typename What, int N>
 using append_times_t = typename append_times<SW, What, N>::type;
 
-template <template <typename...> class SW, typename... Args, typename What>
-struct append_times<SW<Args...>, What, 0> {
-    using type = SW<Args...>;
+template <typename SW, typename Is, typename What>
+struct append_times_impl;
+
+template <template <typename...> class SW, typename... Args, std::size_t... Is, typename What>
+struct append_times_impl<SW<Args...>, std::index_sequence<Is...>, What> {
+    using type = SW<Args..., typename repeat_type<What, Is>::type...>;
 };
 
 template <template <typename...> class SW, typename... Args, typename What, int N>
 struct append_times<SW<Args...>, What, N> {
-    using type = append_times_t<SW<Args..., What>, What, N - 1>;
+    static_assert(N >= 0, "Can't append a negative number of values");
+    using type = typename append_times_impl<SW<Args...>, std::make_index_sequence<N>, What>::type;
 };
 
+// Checks the values above `base`. Nothing below `base` is looked at.
 template <typename... ExpectedArgTypes>
-void check_lua_args(lua_State* state)
+[[nodiscard]] StackError find_stack_error(lua_State* state, int base = 0)
 {
-    if (auto nargs = lua_gettop(state); nargs != sizeof...(ExpectedArgTypes)) {
-        throw std::runtime_error("Expected stack size is " + std::to_string(sizeof...(ExpectedArgTypes)) + " (got " + std::to_string(nargs) + ")");
+    constexpr auto expected_size = int{sizeof...(ExpectedArgTypes)};
+    if (base < 0) {
+        return StackError{StackError::Code::NotEnoughValues, expected_size, lua_gettop(state)};
+    }
+
+    if (auto nargs = lua_gettop(state) - base; nargs != expected_size) {
+        return StackError{StackError::Code::WrongSize, expected_size, nargs};
     }
 
+    auto error = StackError{};
     if constexpr (sizeof...(ExpectedArgTypes) != 0) {
-        impl_check_lua_args<1, ExpectedArgTypes...>(state);
+        impl_find_stack_errors<ExpectedArgTypes...>(state, base, error, std::index_sequence_for<ExpectedArgTypes...>{});
+    }
+    return error;
+}
+
+template <typename... ExpectedArgTypes>
+void check_lua_args(lua_State* state, int base = 0)
+{
+    if (auto error = find_stack_error<ExpectedArgTypes...>(state, base)) {
+        throw_stack_error(state, error);
+    }
+}
+
+// Everything at or below this index is ignored by the wrapper.
+struct StackBase {
+    int index;
+};
+
+// A string key whose Lua string is created only once per state and then cached in the registry under the key's
+// address. Using it doesn't hash the key again. Keys must have static storage duration:
+// inline constexpr lua::Key id_key("id");
+class Key {
+public:
+    constexpr explicit Key(std::string_view name)
+        : m_name(name)
+    {
+    }
+
+    Key(const Key&) = delete;
+    Key& operator=(const Key&) = delete;
+
+    [[nodiscard]] constexpr std::string_view name() const
+    {
+        return m_name;
+    }
+
+private:
+    std::string_view m_name;
+};
+
+inline void push_key(lua_State* state, const Key& key)
+{
+    if (lua_rawgetp(state, LUA_REGISTRYINDEX, &key) == LUA_TSTRING) {
+        return;
     }
+
+    lua_pop(state, 1);
+    lua_pushlstring(state, key.name().data(), key.name().size());
+    lua_pushvalue(state, -1);
+    lua_rawsetp(state, LUA_REGISTRYINDEX, &key);
 }
 
+// Owns a reference to a value stored in the registry with luaL_ref, and releases it with luaL_unref when destroyed. T is
+// the type the value had when it was stored, so pushing it back doesn't need any runtime checks. References are created
+// and pushed by the wrapper:
+// auto callback = lua::Ref<lua::Function>();
+// s.ref(callback); // Pops the function.
+// s.pushref(callback).call<0, 0>();
+// A reference must be destroyed before its state is closed.
+template <typename T>
+class Ref {
+public:
+    Ref() = default;
+
+    Ref(const Ref&) = delete;
+    Ref& operator=(const Ref&) = delete;
+
+    Ref(Ref&& other) noexcept
+        : m_state(std::exchange(other.m_state, nullptr))
+        , m_ref(std::exchange(other.m_ref, LUA_NOREF))
+    {
+    }
+
+    Ref& operator=(Ref&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            m_state = std::exchange(other.m_state, nullptr);
+            m_ref = std::exchange(other.m_ref, LUA_NOREF);
+        }
+        return *this;
+    }
+
+    ~Ref()
+    {
+        reset();
+    }
+
+    // Releases the value, the reference becomes empty.
+    void reset()
+    {
+        if (m_state) {
+            luaL_unref(m_state, LUA_REGISTRYINDEX, m_ref);
+            m_state = nullptr;
+            m_ref = LUA_NOREF;
+        }
+    }
+
+    // Empty references can't be pushed.
+    explicit operator bool() const
+    {
+        return m_state != nullptr;
+    }
+
+    // The registry index of the value, as returned by luaL_ref.
+    [[nodiscard]] int get() const
+    {
+        return m_ref;
+    }
+
+private:
+    template <typename, template <typename...> typename, typename...>
+    friend class impl_StackWrapper;
+
+    // Pops the value on the top of the stack into the registry.
+    explicit Ref(lua_State* state)
+        : m_state(state)
+        , m_ref(luaL_ref(state, LUA_REGISTRYINDEX))
+    {
+    }
+
+    lua_State* m_state = nullptr;
+    int m_ref = LUA_NOREF;
+};
+
 template <typename ToCheck, typename Type>
 struct is_same_or_unknown {
     constexpr static auto value = std::is_same_v<ToCheck, Type> || std::is_same_v<ToCheck, Unknown>;
@@ -225,219 +594,1651 @@ struct is_same_or_unknown {
 template <typename ToCheck, typename Type>
 const auto is_same_or_unknown_v = is_same_or_unknown<ToCheck, Type>::value;
 
+// Like is_same_or_unknown, but also accepts subtypes (an Integer is a Number).
+template <typename ToCheck, typename Type>
+constexpr auto is_a_or_unknown_v = std::is_base_of_v<Type, ToCheck> || std::is_same_v<ToCheck, Unknown>;
+
+// What we know about a value after checking that it's a `Checked`.
+template <typename Current, typename Checked>
+using refined_t = std::conditional_t<std::is_same_v<Current, Unknown>, Checked, Current>;
+
+// Combines callables into a single overload set, like the usual std::visit helper.
+template <typename... Callables>
+struct Overloaded : Callables... {
+    using Callables::operator()...;
+};
+
+struct trusted_t {
+    explicit trusted_t() = default;
+};
+
 template <typename SW>
 class MultiRet;
 
 template <template <typename...> typename SW, typename ...Types>
 class MultiRet<SW<Types...>> {
 public:
-    MultiRet(lua_State* state)
+    MultiRet(lua_State* state, int base = 0, int status = LUA_OK)
         : m_state(state)
+        , m_base(base)
+        , m_status(status)
     {
     }
 
+    // The status returned by lua_pcall or lua_resume (LUA_OK for lua_call).
+    [[nodiscard]] int status() const
+    {
+        return m_status;
+    }
+
     [[nodiscard]] auto type(int n)
     {
-        auto index = n < 0 ? n : n + sizeof...(Types);
+        auto index = n < 0 ? n : n + m_base + int{sizeof...(Types)};
         return lua_type(m_state, index);
     }
 
     [[nodiscard]] auto result_count()
     {
-        return  lua_gettop(m_state) - sizeof...(Types);
+        return  lua_gettop(m_state) - m_base - int{sizeof...(Types)};
+    }
+
+    // Pops the results, leaving the stack as it was below them.
+    [[nodiscard]] auto drop()
+    {
+        lua_settop(m_state, m_base + int{sizeof...(Types)});
+        return SW<Types...>(m_state, StackBase{m_base}, trusted_t{});
     }
 
+    // Only the results are checked, the values below them are already known.
     template <typename... RetVals>
     [[nodiscard]] auto resolve()
     {
-        return SW<Types..., RetVals...>(m_state);
+        constexpr auto known = int{sizeof...(Types)};
+        auto error = find_stack_error<RetVals...>(m_state, m_base + known);
+        auto s = SW<Types..., RetVals...>(m_state, StackBase{m_base}, trusted_t{});
+        if (error) {
+            // Report the error for the whole stack, like the checking constructor would.
+            if (error.code == StackError::Code::WrongSize) {
+                error.expected_size += known;
+                error.size += known;
+            } else {
+                error.index += known;
+            }
+            s.fail(error);
+        }
+        return s;
     }
 
-
 private:
     lua_State* m_state;
+    int m_base;
+    int m_status;
 };
 
-template <template <typename...> typename SW, typename ...Types>
-class impl_StackWrapper {
-public:
-    impl_StackWrapper(lua_State* state)
-        : m_state(state)
-    {
-        check_lua_args<Types...>(state);
-    }
+// Stack operations counted by instrumented wrappers (see InstrumentedPolicy). GetField and SetField cover every table
+// read and write: getfield, rawget, geti and so on.
+enum class Operation {
+    Push,
+    Pop,
+    Rotate,
+    GetField,
+    SetField,
+    Call,
+    PCall,
+    // Runtime type checks of Unknown values, userdata and wrappers created from a lua_State.
+    TypeCheck,
+    Failure,
+};
 
-    template <int N>
-    [[nodiscard]] auto pop()
+constexpr std::size_t operation_count = static_cast<std::size_t>(Operation::Failure) + 1;
+
+// Counters of instrumented wrappers, summed over all threads (including the ones which already exited).
+struct InstrumentationSnapshot {
+    std::array<std::uint64_t, operation_count> operations{};
+    // The largest stack size seen by a wrapper, counting the values below the wrapper's base.
+    int stack_high_water = 0;
+    // Wall time spent in call() and pcall().
+    std::chrono::nanoseconds call_time{0};
+
+    [[nodiscard]] std::uint64_t count(Operation operation) const
     {
-        lua_pop(m_state, N);
-        return pop_back_t<SW<Types...>, N>{m_state};
+        return operations[static_cast<std::size_t>(operation)];
     }
+};
 
-    [[nodiscard]] auto pushinteger(int val)
+// The counters of one thread. Only the owning thread writes them, so updates are plain loads and stores, the atomics
+// only make concurrent snapshots safe.
+class ThreadCounters {
+public:
+    static ThreadCounters& current()
     {
-        lua_pushinteger(m_state, val);
-        return SW<Types..., lua::Number>(m_state);
+        thread_local auto counters = ThreadCounters();
+        return counters;
     }
 
-    [[nodiscard]] auto pushstring(const char* val)
+    void add(Operation operation)
     {
-        lua_pushstring(m_state, val);
-        return SW<Types..., lua::String>(m_state);
+        auto& counter = m_operations[static_cast<std::size_t>(operation)];
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
     }
 
-    [[nodiscard]] auto pushnil()
+    void add_call_time(std::chrono::nanoseconds time)
     {
-        lua_pushnil(m_state);
-        return SW<Types..., lua::Nil>(m_state);
+        m_call_time.store(m_call_time.load(std::memory_order_relaxed) + time.count(), std::memory_order_relaxed);
     }
 
-    [[nodiscard]] auto pushcfunction(lua_CFunction func)
+    void record_stack_size(int size)
     {
-        lua_pushcfunction(m_state, func);
-        return SW<Types..., lua::Function>(m_state);
+        if (size > m_stack_high_water.load(std::memory_order_relaxed)) {
+            m_stack_high_water.store(size, std::memory_order_relaxed);
+        }
     }
 
-    [[nodiscard]] auto newtable()
+    // Counters of all the threads which used an instrumented wrapper.
+    static InstrumentationSnapshot snapshot()
     {
-        lua_newtable(m_state);
-        return SW<Types..., lua::Table>(m_state);
+        auto& registry = get_registry();
+        auto lock = std::lock_guard(registry.mutex);
+        auto result = registry.retired;
+        for (auto counters : registry.threads) {
+            counters->add_to(result);
+        }
+        return result;
     }
 
-    template <int NArgs, int NResults>
-    [[nodiscard]] auto call()
+    ThreadCounters(const ThreadCounters&) = delete;
+    ThreadCounters& operator=(const ThreadCounters&) = delete;
+
+    ~ThreadCounters()
     {
-        static_assert(stack_size >= NArgs + 1, "Not enough elements on the stack for a function call");
-        static_assert(is_same_or_unknown_v<ValueType<-1 - NArgs>, Function>, "The called element is not a function.");
-        lua_call(m_state, NArgs, NResults);
+        auto& registry = get_registry();
+        auto lock = std::lock_guard(registry.mutex);
+        add_to(registry.retired);
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+    }
 
-        using TypeAfterCall = pop_back_t<SW<Types...>, NArgs + 1>;
+private:
+    struct Registry {
+        std::mutex mutex;
+        std::vector<ThreadCounters*> threads;
+        InstrumentationSnapshot retired;
+    };
 
-        if constexpr (NResults == LUA_MULTRET) {
-            return MultiRet<TypeAfterCall>(m_state);
-        } else {
-            return append_times_t<TypeAfterCall, Unknown, NResults>(m_state);
-        }
+    ThreadCounters()
+    {
+        auto& registry = get_registry();
+        auto lock = std::lock_guard(registry.mutex);
+        registry.threads.push_back(this);
+    }
 
+    static Registry& get_registry()
+    {
+        static auto registry = Registry();
+        return registry;
     }
 
-    template <int NArgs, int NResults, int MsgHandler>
-    [[nodiscard]] auto pcall()
+    void add_to(InstrumentationSnapshot& snapshot) const
     {
-        static_assert(stack_size >= NArgs + 1, "Not enough elements on the stack for a function call");
-        static_assert(is_same_or_unknown_v<ValueType<-1 - NArgs>, Function>, "The called element is not a function.");
-        if constexpr (MsgHandler != 0) {
-            static_assert(is_same_or_unknown_v<ValueType<MsgHandler>, Function> || is_same_or_unknown_v<ValueType<MsgHandler>, Table>, "The message handler is not a function or a table.");
+        for (auto i = std::size_t{0}; i < operation_count; i++) {
+            snapshot.operations[i] += m_operations[i].load(std::memory_order_relaxed);
         }
-        lua_pcall(m_state, NArgs, NResults, MsgHandler);
+        snapshot.stack_high_water = std::max(snapshot.stack_high_water, m_stack_high_water.load(std::memory_order_relaxed));
+        snapshot.call_time += std::chrono::nanoseconds(m_call_time.load(std::memory_order_relaxed));
+    }
 
-        using TypeAfterCall = pop_back_t<SW<Types...>, NArgs + 1>;
+    std::array<std::atomic<std::uint64_t>, operation_count> m_operations{};
+    std::atomic<int> m_stack_high_water{0};
+    std::atomic<std::chrono::nanoseconds::rep> m_call_time{0};
+};
 
-        return MultiRet<TypeAfterCall>(m_state);
-    }
+inline InstrumentationSnapshot instrumentation_snapshot()
+{
+    return ThreadCounters::snapshot();
+}
 
-    template <int IDX, int N>
-    [[nodiscard]] auto rotate()
+// Validation policies decide how much runtime checking a StackWrapper does. Creating a wrapper directly from a
+// lua_State is where the user asserts what's on the stack, so that is always checked in full. Wrappers produced by the
+// wrapper's own operations are trusted by default, because their shape follows from the compile-time type list.
+struct DefaultPolicy {
+    constexpr static bool validate_transitions = false;
+    // How many values (counted from the base) the stack is known to have room for. -1 means nothing was reserved and the
+    // stack size isn't checked.
+    constexpr static int capacity = -1;
+    // Whether operations are counted, see InstrumentedPolicy.
+    constexpr static bool instrumented = false;
+
+    // Reports runtime check failures. It must not return.
+    [[noreturn]] static void fail(lua_State* state, const StackError& error)
     {
-        lua_rotate(m_state, IDX, N);
-        return rotate_t<SW<Types...>, IDX, N>{m_state};
+        throw_stack_error(state, error);
     }
+};
 
-    template <int IDX>
-    [[nodiscard]] auto insert()
+// Reports failures as Lua errors instead of C++ exceptions. Only use it in code called by Lua (for example inside a
+// lua_CFunction), where the error can't unwind through C++ frames with non-trivial destructors.
+struct LuaErrorPolicy : DefaultPolicy {
+    [[noreturn]] static void fail(lua_State* state, const StackError& error)
     {
-        return rotate<IDX, 1>();
+        raise_stack_error(state, error);
     }
+};
 
-    template <typename Callable>
-    [[nodiscard]] auto gettop(Callable&& callable)
-    {
-        callable(lua_gettop(m_state));
-        return SW<Types...>(m_state);
-    }
+// Revalidates the whole stack after every operation. Useful for debugging code that touches the stack behind the
+// wrapper's back.
+struct ParanoidPolicy : DefaultPolicy {
+    constexpr static bool validate_transitions = true;
+};
 
-    template <int N>
-    [[nodiscard]] auto setfield(const char* key)
+// Used by reserve(). Every operation checks in compile time that the stack stays within the reserved capacity, so the
+// pushes themselves don't need to call lua_checkstack.
+template <typename Policy, int Capacity>
+struct ReservedPolicy : Policy {
+    constexpr static int capacity = Capacity;
+};
+
+// Counts operations in per-thread counters, read them with lua::instrumentation_snapshot(). Other policies stay
+// zero-cost, the counting code is only compiled for instrumented wrappers:
+// lua::with_policy<lua::InstrumentedPolicy<>>::StackWrapper<>(state)...
+template <typename Policy = DefaultPolicy>
+struct InstrumentedPolicy : Policy {
+    constexpr static bool instrumented = true;
+};
+
+template <typename Policy>
+struct with_policy;
+
+// Maps C++ types to Lua values. `type` is the type of the pushed value on the stack. `read` checks the type of a value
+// and converts it, it returns false (and leaves `out` alone) if the value has the wrong type.
+template <typename T, typename = void>
+struct Value;
+
+template <>
+struct Value<bool> {
+    using type = Boolean;
+
+    static void push(lua_State* state, bool value)
     {
-        static_assert(toAbsoluteIndex(stack_size, N) != stack_size, "Can't use setfield with a table on top of the stack");
-        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
-        check_unknown<N, Table>();
-        lua_setfield(m_state, N, key);
-        return pop_back_t<replace_type_t<SW<Types...>, N, Table>, 1>{m_state};
+        lua_pushboolean(state, value);
     }
 
-    template <int N>
-    [[nodiscard]] auto getfield(const char* key)
+    static bool read(lua_State* state, int index, bool& out)
     {
-        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
-        check_unknown<N, Table>();
-        lua_getfield(m_state, N, key);
-        return concat_types_t<replace_type_t<SW<Types...>, N, Table>, SW<lua::Unknown>>(m_state);
+        if (lua_type(state, index) != LUA_TBOOLEAN) {
+            return false;
+        }
+        out = lua_toboolean(state, index);
+        return true;
     }
+};
 
-    template <int N, typename Callable>
-    [[nodiscard]] auto tocfunction(Callable&& callable)
+template <typename T>
+struct Value<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>> {
+    using type = Integer;
+
+    static void push(lua_State* state, T value)
     {
-        static_assert(is_same_or_unknown_v<ValueType<N>, Function>, "The selected element is not a function.");
-        check_unknown<N, Function>();
-        callable(lua_tocfunction(m_state, N));
-        return replace_type_t<SW<Types...>, N, Function>(m_state);
+        lua_pushinteger(state, static_cast<lua_Integer>(value));
     }
 
-    template <int N, typename Callable>
-    [[nodiscard]] auto tostring(Callable&& callable)
+    // Floats with an exact integer representation are accepted, numeric strings and values out of T's range aren't.
+    static bool read(lua_State* state, int index, T& out)
     {
-        static_assert(is_same_or_unknown_v<ValueType<N>, String>, "The selected element is not a string.");
+        if (lua_type(state, index) != LUA_TNUMBER) {
+            return false;
+        }
+        int is_integer;
+        auto value = lua_tointegerx(state, index, &is_integer);
+        if (!is_integer) {
+            return false;
+        }
+        if constexpr (std::is_unsigned_v<T>) {
+            if (value < 0 || static_cast<std::make_unsigned_t<lua_Integer>>(value) > std::numeric_limits<T>::max()) {
+                return false;
+            }
+        } else {
+            if (value < std::numeric_limits<T>::min() || value > std::numeric_limits<T>::max()) {
+                return false;
+            }
+        }
+        out = static_cast<T>(value);
+        return true;
+    }
+};
+
+template <typename T>
+struct Value<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+    using type = Float;
+
+    static void push(lua_State* state, T value)
+    {
+        lua_pushnumber(state, static_cast<lua_Number>(value));
+    }
+
+    static bool read(lua_State* state, int index, T& out)
+    {
+        if (lua_type(state, index) != LUA_TNUMBER) {
+            return false;
+        }
+        out = static_cast<T>(lua_tonumber(state, index));
+        return true;
+    }
+};
+
+template <typename T>
+struct Value<T, std::enable_if_t<std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>>> {
+    using type = String;
+
+    static void push(lua_State* state, std::string_view value)
+    {
+        lua_pushlstring(state, value.data(), value.size());
+    }
+
+    // A std::string_view points into the Lua string, it's only valid while the string is reachable from Lua.
+    static bool read(lua_State* state, int index, T& out)
+    {
+        if (lua_type(state, index) != LUA_TSTRING) {
+            return false;
+        }
+        std::size_t length;
+        auto str = lua_tolstring(state, index, &length);
+        out = T(str, length);
+        return true;
+    }
+};
+
+template <>
+struct Value<const char*> {
+    using type = String;
+
+    static void push(lua_State* state, const char* value)
+    {
+        lua_pushstring(state, value);
+    }
+
+    // Points into the Lua string, it's only valid while the string is reachable from Lua.
+    static bool read(lua_State* state, int index, const char*& out)
+    {
+        if (lua_type(state, index) != LUA_TSTRING) {
+            return false;
+        }
+        out = lua_tostring(state, index);
+        return true;
+    }
+};
+
+// Table schemas describe how a C++ struct maps to a Lua table:
+// constexpr auto point_schema = lua::schema(lua::field("x", &Point::x), lua::field("y", &Point::y));
+template <typename Struct, typename Member>
+struct Field {
+    const char* name;
+    Member Struct::* member;
+};
+
+template <typename Struct, typename Member>
+constexpr auto field(const char* name, Member Struct::* member)
+{
+    return Field<Struct, Member>{name, member};
+}
+
+// The elements of a container member, stored in the array part of the table (at indices 1 to size()).
+template <typename Struct, typename Member>
+struct Elements {
+    Member Struct::* member;
+};
+
+template <typename Struct, typename Member>
+constexpr auto elements(Member Struct::* member)
+{
+    return Elements<Struct, Member>{member};
+}
+
+template <typename T>
+struct is_elements : std::false_type {
+};
+
+template <typename Struct, typename Member>
+struct is_elements<Elements<Struct, Member>> : std::true_type {
+};
+
+template <typename... Fields>
+struct Schema {
+    static_assert((0 + ... + int{is_elements<Fields>::value}) <= 1, "A table can only have one array part.");
+    constexpr static int record_count = (0 + ... + int{!is_elements<Fields>::value});
+
+    std::tuple<Fields...> fields;
+};
+
+template <typename... Fields>
+constexpr auto schema(Fields... fields)
+{
+    return Schema<Fields...>{std::tuple<Fields...>{fields...}};
+}
+
+// The result of reading a table into a struct. It converts to false if a value had the wrong type. In that case,
+// `field` is the name of the first such field (or nullptr for an array element at `index`), `expected` is the name of
+// the expected type and `got` is the type the value had.
+struct ReadResult {
+    const char* expected = nullptr;
+    const char* field = nullptr;
+    lua_Integer index = 0;
+    int got = LUA_TNONE;
+
+    explicit operator bool() const
+    {
+        return expected == nullptr;
+    }
+};
+
+// How many values a function returns. Tuples are returned as multiple values.
+template <typename T>
+struct result_count : std::integral_constant<int, 1> {
+};
+
+template <>
+struct result_count<void> : std::integral_constant<int, 0> {
+};
+
+template <typename... Ts>
+struct result_count<std::tuple<Ts...>> : std::integral_constant<int, sizeof...(Ts)> {
+};
+
+template <typename T>
+struct is_tuple : std::false_type {
+};
+
+template <typename... Ts>
+struct is_tuple<std::tuple<Ts...>> : std::true_type {
+};
+
+// Whether a C++ value points into a Lua value, so it's only valid while that value is on the stack.
+template <typename T>
+struct is_lua_view : std::bool_constant<std::is_same_v<T, std::string_view> || std::is_same_v<T, const char*>> {
+};
+
+template <typename... Ts>
+struct is_lua_view<std::tuple<Ts...>> : std::bool_constant<(is_lua_view<Ts>::value || ...)> {
+};
+
+template <typename Signature, typename Policy = DefaultPolicy>
+class PreparedCall;
+
+// Calls the same Lua function over and over with a fixed signature: the arguments are C++ values, and the results are
+// converted back to C++ (a std::tuple for multiple results). Every call is a lua_rawgeti, the pushes, a lua_pcall, one
+// type check per result and a single lua_pop, the stack is left exactly as it was. Nothing else is validated, so it's
+// cheap enough for inner loops:
+// auto process = lua::PreparedCall<lua_Integer(std::string_view)>();
+// lua::StackWindow<lua::Function>(state).prepare(process);
+// for (const auto& record : records) {
+//     total += process(record);
+// }
+// Errors raised by the function and results with the wrong type are reported through the policy.
+template <typename R, typename... Args, typename Policy>
+class PreparedCall<R(Args...), Policy> {
+public:
+    PreparedCall() = default;
+
+    PreparedCall(lua_State* state, Ref<Function> function)
+        : m_state(state)
+        , m_function(std::move(function))
+    {
+    }
+
+    // Must not be called on an empty PreparedCall.
+    template <typename Result = R, std::enable_if_t<!is_lua_view<Result>::value, int> = 0>
+    R operator()(const Args&... args) const
+    {
+        lua_rawgeti(m_state, LUA_REGISTRYINDEX, m_function.get());
+        (Value<Args>::push(m_state, args), ...);
+        if (lua_pcall(m_state, int{sizeof...(Args)}, nresults, 0) != LUA_OK) {
+            Policy::fail(m_state, StackError{StackError::Code::RuntimeError});
+        }
+
+        if constexpr (std::is_void_v<R>) {
+            return;
+        } else {
+            auto results = R{};
+            auto error = StackError{};
+            if constexpr (!is_tuple<R>::value) {
+                read_result(results, 0, error);
+            } else {
+                std::apply([this, &error] (auto&... result) {
+                    [[maybe_unused]] auto i = 0;
+                    (read_result(result, i++, error) && ...);
+                }, results);
+            }
+            lua_pop(m_state, nresults);
+            if (error) {
+                Policy::fail(m_state, error);
+            }
+            return results;
+        }
+    }
+
+    // The results are popped before they're returned, so strings must be returned as std::string, a std::string_view or
+    // a const char* would point into a string Lua can already have collected.
+    template <typename Result = R, std::enable_if_t<is_lua_view<Result>::value, int> = 0>
+    R operator()(const Args&... args) const = delete;
+
+    explicit operator bool() const
+    {
+        return static_cast<bool>(m_function);
+    }
+
+private:
+    constexpr static int nresults = result_count<R>::value;
+
+    // `i` counts the results from 0. In errors, results are numbered from 1.
+    template <typename T>
+    bool read_result(T& out, int i, StackError& error) const
+    {
+        auto index = i - nresults;
+        if (!Value<T>::read(m_state, index, out)) {
+            error = StackError{StackError::Code::WrongType, 0, 0, i + 1, Value<T>::type::name, lua_type(m_state, index)};
+            return false;
+        }
+        return true;
+    }
+
+    lua_State* m_state = nullptr;
+    Ref<Function> m_function;
+};
+
+// Defined in lua-cts-msgpack.hpp, which has to be included to use the wrapper's tomsgpack and pushmsgpack.
+class MessagePack;
+
+template <typename Start, typename Current, typename Ops = std::tuple<>>
+class LazyChain;
+
+template <typename Policy, template <typename...> typename SW, typename ...Types>
+class impl_StackWrapper {
+public:
+    impl_StackWrapper(lua_State* state)
+        : impl_StackWrapper(state, StackBase{0})
+    {
+    }
+
+    impl_StackWrapper(lua_State* state, StackBase base)
+        : m_state(state)
+        , m_base(base.index)
+    {
+        record<Operation::TypeCheck>();
+        if (auto error = find_stack_error<Types...>(state, m_base)) {
+            fail(error);
+        }
+        record_stack_size();
+    }
+
+    // Checks the stack without going through the policy: `on_success` gets the wrapper, `on_error` a lua::StackError.
+    // Both must return the same type. Useful for checking values from untrusted code without exceptions.
+    template <typename OnSuccess, typename OnError>
+    static auto try_create(lua_State* state, StackBase base, OnSuccess&& on_success, OnError&& on_error)
+    {
+        if (auto error = find_stack_error<Types...>(state, base.index)) {
+            return on_error(error);
+        }
+        return on_success(SW<Types...>(state, base, trusted_t{}));
+    }
+
+    template <typename OnSuccess, typename OnError>
+    static auto try_create(lua_State* state, OnSuccess&& on_success, OnError&& on_error)
+    {
+        return try_create(state, StackBase{0}, std::forward<OnSuccess>(on_success), std::forward<OnError>(on_error));
+    }
+
+    template <int N>
+    [[nodiscard]] auto pop()
+    {
+        record<Operation::Pop>();
+        lua_pop(m_state, N);
+        return transition<pop_back_t<SW<Types...>, N>>();
+    }
+
+    [[nodiscard]] auto pushinteger(lua_Integer val)
+    {
+        record<Operation::Push>();
+        lua_pushinteger(m_state, val);
+        return transition<SW<Types..., lua::Integer>>();
+    }
+
+    [[nodiscard]] auto pushnumber(lua_Number val)
+    {
+        record<Operation::Push>();
+        lua_pushnumber(m_state, val);
+        return transition<SW<Types..., lua::Float>>();
+    }
+
+    [[nodiscard]] auto pushboolean(bool val)
+    {
+        record<Operation::Push>();
+        lua_pushboolean(m_state, val);
+        return transition<SW<Types..., lua::Boolean>>();
+    }
+
+    // Creates a full userdata holding a T constructed from `args`. Its metatable is cached in the registry, and runs T's
+    // destructor when the userdata is collected.
+    template <typename T, typename... Args>
+    [[nodiscard]] auto pushuserdata(Args&&... args)
+    {
+        record<Operation::Push>();
+        static_assert(alignof(T) <= alignof(std::max_align_t), "Lua doesn't align userdata for over-aligned types.");
+        static_assert(has_room_for<3>, "The stack would grow past the reserved capacity, reserve more values.");
+        auto memory = lua_newuserdatauv(m_state, sizeof(T), 0);
+        try {
+            new (memory) T(std::forward<Args>(args)...);
+        } catch (...) {
+            lua_pop(m_state, 1);
+            throw;
+        }
+        push_userdata_metatable<T>(m_state);
+        lua_setmetatable(m_state, -2);
+        return transition<SW<Types..., lua::UserdataOf<T>>>();
+    }
+
+    // Pushes the metatable of userdata holding a T, for example to add methods to it.
+    template <typename T>
+    [[nodiscard]] auto pushmetatable()
+    {
+        record<Operation::Push>();
+        static_assert(has_room_for<2>, "The stack would grow past the reserved capacity, reserve more values.");
+        push_userdata_metatable<T>(m_state);
+        return transition<SW<Types..., lua::Table>>();
+    }
+
+    [[nodiscard]] auto pushlightuserdata(void* val)
+    {
+        record<Operation::Push>();
+        lua_pushlightuserdata(m_state, val);
+        return transition<SW<Types..., lua::LightUserdata>>();
+    }
+
+    [[nodiscard]] auto pushstring(const char* val)
+    {
+        record<Operation::Push>();
+        lua_pushstring(m_state, val);
+        return transition<SW<Types..., lua::String>>();
+    }
+
+    // Unlike pushstring, the string doesn't need to be NUL-terminated and can contain embedded zeros.
+    [[nodiscard]] auto pushlstring(std::string_view val)
+    {
+        record<Operation::Push>();
+        lua_pushlstring(m_state, val.data(), val.size());
+        return transition<SW<Types..., lua::String>>();
+    }
+
+    // The length of a string literal is known in compile time, so there's no need to call strlen.
+    template <std::size_t Length>
+    [[nodiscard]] auto pushliteral(const char (&val)[Length])
+    {
+        record<Operation::Push>();
+        lua_pushlstring(m_state, val, Length - 1);
+        return transition<SW<Types..., lua::String>>();
+    }
+
+    [[nodiscard]] auto pushnil()
+    {
+        record<Operation::Push>();
+        lua_pushnil(m_state);
+        return transition<SW<Types..., lua::Nil>>();
+    }
+
+    [[nodiscard]] auto pushcfunction(lua_CFunction func)
+    {
+        record<Operation::Push>();
+        lua_pushcfunction(m_state, func);
+        return transition<SW<Types..., lua::Function>>();
+    }
+
+    // Pops NUpvalues values and pushes a C closure with them as its upvalues.
+    template <int NUpvalues>
+    [[nodiscard]] auto pushcclosure(lua_CFunction func)
+    {
+        record<Operation::Push>();
+        static_assert(NUpvalues >= 0 && NUpvalues <= stack_size, "Not enough elements on the stack for the upvalues");
+        lua_pushcclosure(m_state, func, NUpvalues);
+        return transition<push_type_t<pop_back_t<SW<Types...>, NUpvalues>, lua::Function>>();
+    }
+
+    [[nodiscard]] auto newtable()
+    {
+        record<Operation::Push>();
+        lua_newtable(m_state);
+        return transition<SW<Types..., lua::Table>>();
+    }
+
+    // Preallocates space for `narr` array elements and `nrec` other fields.
+    [[nodiscard]] auto createtable(int narr, int nrec)
+    {
+        record<Operation::Push>();
+        lua_createtable(m_state, narr, nrec);
+        return transition<SW<Types..., lua::Table>>();
+    }
+
+    // Pushes a table built from `value` according to `schema`. The table is created with the exact number of fields (and
+    // array elements), so it never has to be resized while it's being filled.
+    template <typename Struct, typename... Fields>
+    [[nodiscard]] auto pushtable(const Struct& value, const Schema<Fields...>& schema)
+    {
+        record<Operation::Push>();
+        static_assert(has_room_for<2>, "The stack would grow past the reserved capacity, reserve more values.");
+        std::apply([this, &value] (const auto&... fields) {
+            lua_createtable(m_state, (0 + ... + array_size(value, fields)), Schema<Fields...>::record_count);
+            (store_field(value, fields), ...);
+        }, schema.fields);
+        return transition<SW<Types..., lua::Table>>();
+    }
+
+    template <int NArgs, int NResults>
+    [[nodiscard]] auto call()
+    {
+        static_assert(stack_size >= NArgs + 1, "Not enough elements on the stack for a function call");
+        static_assert(is_same_or_unknown_v<ValueType<-1 - NArgs>, Function>, "The called element is not a function.");
+        if constexpr (Policy::instrumented) {
+            record<Operation::Call>();
+            auto start = std::chrono::steady_clock::now();
+            lua_call(m_state, NArgs, NResults);
+            ThreadCounters::current().add_call_time(std::chrono::steady_clock::now() - start);
+        } else {
+            lua_call(m_state, NArgs, NResults);
+        }
+
+        using TypeAfterCall = pop_back_t<SW<Types...>, NArgs + 1>;
+
+        if constexpr (NResults == LUA_MULTRET) {
+            return MultiRet<TypeAfterCall>(m_state, m_base);
+        } else {
+            return transition<append_times_t<TypeAfterCall, Unknown, NResults>>();
+        }
+
+    }
+
+    template <int NArgs, int NResults, int MsgHandler>
+    [[nodiscard]] auto pcall()
+    {
+        static_assert(stack_size >= NArgs + 1, "Not enough elements on the stack for a function call");
+        static_assert(is_same_or_unknown_v<ValueType<-1 - NArgs>, Function>, "The called element is not a function.");
+        if constexpr (MsgHandler != 0) {
+            static_assert(is_same_or_unknown_v<ValueType<MsgHandler>, Function> || is_same_or_unknown_v<ValueType<MsgHandler>, Table>, "The message handler is not a function or a table.");
+        }
+        auto status = LUA_OK;
+        [[maybe_unused]] auto start = std::chrono::steady_clock::time_point{};
+        if constexpr (Policy::instrumented) {
+            record<Operation::PCall>();
+            start = std::chrono::steady_clock::now();
+        }
+        if constexpr (MsgHandler != 0) {
+            status = lua_pcall(m_state, NArgs, NResults, index<MsgHandler>);
+        } else {
+            status = lua_pcall(m_state, NArgs, NResults, 0);
+        }
+        if constexpr (Policy::instrumented) {
+            ThreadCounters::current().add_call_time(std::chrono::steady_clock::now() - start);
+        }
+
+        using TypeAfterCall = pop_back_t<SW<Types...>, NArgs + 1>;
+
+        return MultiRet<TypeAfterCall>(m_state, m_base, status);
+    }
+
+    // Compiles a chunk (source code or bytecode, `mode` is passed to lua_load). On success `on_success` gets the wrapper
+    // with the chunk pushed as a Function, otherwise `on_error` gets it with the error message pushed as a String. Both
+    // must return the same type:
+    // auto s = lua::StackWrapper<>(state).load(code, "=config", nullptr, [] (auto s) {
+    //     return s.template call<0, 0>();
+    // }, [] (auto s) {
+    //     return s.template tostring<-1>(log_error).template pop<1>();
+    // });
+    template <typename OnSuccess, typename OnError>
+    auto load(std::string_view chunk, const char* chunkname, const char* mode, OnSuccess&& on_success, OnError&& on_error)
+    {
+        record<Operation::Push>();
+        if (luaL_loadbufferx(m_state, chunk.data(), chunk.size(), chunkname, mode) == LUA_OK) {
+            return on_success(transition<SW<Types..., lua::Function>>());
+        }
+        return on_error(transition<SW<Types..., lua::String>>());
+    }
+
+    template <typename OnSuccess, typename OnError>
+    auto load(std::string_view chunk, const char* chunkname, OnSuccess&& on_success, OnError&& on_error)
+    {
+        return load(chunk, chunkname, nullptr, std::forward<OnSuccess>(on_success), std::forward<OnError>(on_error));
+    }
+
+    // Passes the bytecode of the Lua function at N to `writer` as std::string_views, in one or more pieces. Stripping
+    // removes the debug information, which makes the bytecode smaller but error messages less useful. Exceptions thrown
+    // by the writer stop the dump and are rethrown.
+    template <int N, typename Writer>
+    [[nodiscard]] auto dump(Writer&& writer, bool strip = false)
+    {
+        static_assert(is_same_or_unknown_v<ValueType<N>, Function>, "The selected element is not a function.");
+        static_assert(has_room_for<1>, "The stack would grow past the reserved capacity, reserve more values.");
+        check_unknown<N, Function>();
+        if (lua_iscfunction(m_state, index<N>)) {
+            fail_wrong_type<N>("Lua function");
+        }
+
+        struct Context {
+            Writer& writer;
+            std::exception_ptr error;
+        };
+        auto context = Context{writer, nullptr};
+        lua_pushvalue(m_state, index<N>);
+        lua_dump(m_state, [] (lua_State*, const void* data, std::size_t size, void* userdata) {
+            auto& context = *static_cast<Context*>(userdata);
+            try {
+                context.writer(std::string_view(static_cast<const char*>(data), size));
+                return 0;
+            } catch (...) {
+                context.error = std::current_exception();
+                return 1;
+            }
+        }, &context, strip);
+        lua_pop(m_state, 1);
+        if (context.error) {
+            std::rethrow_exception(context.error);
+        }
+        return transition<replace_type_t<SW<Types...>, N, Function>>();
+    }
+
+    // Pushes a new coroutine, tothread gets its lua_State.
+    [[nodiscard]] auto newthread()
+    {
+        record<Operation::Push>();
+        lua_newthread(m_state);
+        return transition<SW<Types..., lua::Thread>>();
+    }
+
+    // Moves the top N values to the stack of another thread of the same state, represented by the wrapper `to`. Returns
+    // the wrappers of both stacks:
+    // auto [s2, t2] = s.xmove<1>(t);
+    template <int N, typename To>
+    [[nodiscard]] auto xmove(To& to)
+    {
+        static_assert(N >= 0 && N <= stack_size, "Can't move more values than present on the stack");
+        lua_xmove(m_state, to.m_state, N);
+        return std::pair(transition<pop_back_t<SW<Types...>, N>>(), to.template transition<concat_types_t<To, pop_front_t<SW<Types...>, stack_size - N>>>());
+    }
+
+    // Starts or resumes the coroutine whose stack this wrapper represents, passing it the top NArgs values. What's left on
+    // its stack depends on how the coroutine stopped, so there's a continuation for each case:
+    // - on_return gets a MultiRet with the returned values on top of what the wrapper knew below the coroutine's function
+    // - on_yield gets a MultiRet with the yielded values. A suspended coroutine keeps its own frames on its stack, so
+    //   they're in a new window on the top of it. Resume it from that window, after replacing them with the arguments.
+    // - on_error gets the error object, also in a new window
+    // If the wrapper holds more values than the arguments, the value right below them is the function, and the coroutine
+    // is started. Otherwise the wrapper must be a window of exactly the arguments of a suspended coroutine:
+    // auto [s2, t2] = s.pushcfunction(body).pushinteger(1).xmove<2>(lua::StackWindow<>(thread));
+    // t2.resume<1>(state, [] (auto returned) { ... }, [] (auto yielded) { ... }, [] (auto error) { ... });
+    // The continuations must return the same type.
+    template <int NArgs, typename OnReturn, typename OnYield, typename OnError>
+    auto resume(lua_State* from, OnReturn&& on_return, OnYield&& on_yield, OnError&& on_error)
+    {
+        static_assert(NArgs >= 0 && NArgs <= stack_size, "Not enough elements on the stack for resuming a coroutine");
+        constexpr auto starting = stack_size > NArgs;
+        if constexpr (starting) {
+            static_assert(is_same_or_unknown_v<ValueType<-1 - NArgs>, Function>, "The value below the arguments is not a function.");
+        }
+        auto nresults = 0;
+        auto status = lua_resume(m_state, from, NArgs, &nresults);
+        if (status == LUA_YIELD) {
+            return on_yield(MultiRet<SW<>>(m_state, lua_gettop(m_state) - nresults, status));
+        }
+        if (status != LUA_OK) {
+            return on_error(SW<Unknown>(m_state, StackBase{lua_gettop(m_state) - 1}, trusted_t{}));
+        }
+        if constexpr (starting) {
+            return on_return(MultiRet<pop_back_t<SW<Types...>, NArgs + 1>>(m_state, m_base, status));
+        } else {
+            return on_return(MultiRet<SW<>>(m_state, lua_gettop(m_state) - nresults, status));
+        }
+    }
+
+    // Yields the top NResults values from a C function running inside a coroutine. The C function must return the
+    // result right away:
+    // return s.yield<1>();
+    template <int NResults>
+    [[nodiscard]] int yield()
+    {
+        static_assert(NResults >= 0 && NResults <= stack_size, "Can't yield more values than present on the stack");
+        return lua_yield(m_state, NResults);
+    }
+
+    template <int IDX, int N>
+    [[nodiscard]] auto rotate()
+    {
+        record<Operation::Rotate>();
+        lua_rotate(m_state, index<IDX>, N);
+        return transition<rotate_t<SW<Types...>, IDX, N>>();
+    }
+
+    template <int IDX>
+    [[nodiscard]] auto insert()
+    {
+        return rotate<IDX, 1>();
+    }
+
+    // Makes room for N more values with a single lua_checkstack. The returned wrapper knows the reserved capacity, and
+    // growing the stack past it fails to compile. Reserving space that was already reserved is free.
+    template <int N>
+    [[nodiscard]] auto reserve()
+    {
+        static_assert(N >= 0, "Can't reserve a negative number of values");
+        constexpr auto new_capacity = stack_size + N;
+        if constexpr (Policy::capacity >= new_capacity) {
+            return transition<SW<Types...>>();
+        } else {
+            if (!lua_checkstack(m_state, N)) {
+                fail(StackError{StackError::Code::StackOverflow, N, stack_size});
+            }
+            return transition<typename SW<Types...>::template rebind_policy<ReservedPolicy<Policy, new_capacity>>>();
+        }
+    }
+
+    // Pushes a sequence with the elements of a contiguous buffer. The table is created with its final size, or as
+    // large as lua_createtable allows, the rest of it grows as usual.
+    template <typename T>
+    [[nodiscard]] auto pusharray(const T* data, std::size_t size)
+    {
+        record<Operation::Push>();
+        static_assert(has_room_for<2>, "The stack would grow past the reserved capacity, reserve more values.");
+        constexpr auto max_hint = static_cast<std::size_t>(std::numeric_limits<int>::max());
+        lua_createtable(m_state, static_cast<int>(std::min(size, max_hint)), 0);
+        auto i = lua_Integer{1};
+        for (auto end = data + size; data != end; data++) {
+            Value<T>::push(m_state, *data);
+            lua_rawseti(m_state, -2, i++);
+        }
+        return transition<SW<Types..., lua::Table>>();
+    }
+
+    // Works with any contiguous container: std::vector, std::array, ...
+    template <typename Container>
+    [[nodiscard]] auto pusharray(const Container& container)
+    {
+        return pusharray(std::data(container), std::size(container));
+    }
+
+    // Reads the sequence at N into `out`, which is resized to the length of the sequence. The callable receives a
+    // lua::ReadResult, reading stops at the first element with the wrong type.
+    template <int N, typename T, typename Callable>
+    [[nodiscard]] auto toarray(std::vector<T>& out, Callable&& callable)
+    {
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        static_assert(has_room_for<1>, "The stack would grow past the reserved capacity, reserve more values.");
+        check_unknown<N, Table>();
+        auto size = static_cast<lua_Integer>(lua_rawlen(m_state, index<N>));
+        out.resize(static_cast<std::size_t>(size));
+        auto result = ReadResult{};
+        read_sequence<index<N>>(out.begin(), size, result);
+        callable(result);
+        return transition<replace_type_t<SW<Types...>, N, Table>>();
+    }
+
+    // Reads at most `capacity` elements of the sequence at N into a preallocated buffer. The callable receives a
+    // lua::ReadResult and the length of the sequence, which can be larger than `capacity`.
+    template <int N, typename T, typename Callable>
+    [[nodiscard]] auto toarray(T* out, std::size_t capacity, Callable&& callable)
+    {
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        static_assert(has_room_for<1>, "The stack would grow past the reserved capacity, reserve more values.");
+        check_unknown<N, Table>();
+        auto length = static_cast<std::size_t>(lua_rawlen(m_state, index<N>));
+        auto result = ReadResult{};
+        read_sequence<index<N>>(out, static_cast<lua_Integer>(std::min(length, capacity)), result);
+        callable(result, length);
+        return transition<replace_type_t<SW<Types...>, N, Table>>();
+    }
+
+    // Calls `callable` for every key/value pair of the table at N (in lua_next order, metamethods are skipped). It gets
+    // the wrapper with the key and the value pushed as lua::Unknown, and must return it with both still on the stack,
+    // so every step leaves the stack as it was. The key must not be modified, values can be read and refined:
+    // auto s2 = s.for_each<1>([&sum] (auto s) {
+    //     return s.template tointeger<-1>([&sum] (lua_Integer x) { sum += x; });
+    // });
+    template <int N, typename Callable>
+    [[nodiscard]] auto for_each(Callable&& callable)
+    {
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        static_assert(has_room_for<2>, "The stack would grow past the reserved capacity, reserve more values.");
+        check_unknown<N, Table>();
+        using Step = SW<Types..., lua::Unknown, lua::Unknown>;
+        using Result = std::invoke_result_t<Callable&, Step>;
+        static_assert(!std::is_void_v<Result>, "The callable must return the wrapper it got.");
+        static_assert(Result::stack_size == stack_size + 2, "The callable must leave the key and the value on the stack.");
+
+        record<Operation::Push>();
+        lua_pushnil(m_state);
+        // The key is on top of the stack, so the table is one slot further from it.
+        while (lua_next(m_state, index<N> - 1)) {
+            record<Operation::GetField>();
+            (void)callable(transition<Step>());
+            record<Operation::Pop>();
+            lua_pop(m_state, 1);
+        }
+        return transition<replace_type_t<SW<Types...>, N, Table>>();
+    }
+
+    // Calls `callable` for every element of the sequence at N, from 1 to its raw length, without going through the hash
+    // part. It gets the wrapper with the element pushed as lua::Unknown and the element's index, and must return the
+    // wrapper with the element still on the stack:
+    // auto s2 = s.for_each_index<1>([&names] (auto s, lua_Integer) {
+    //     return s.template tolstring<-1>([&names] (std::string_view x) { names.emplace_back(x); });
+    // });
+    template <int N, typename Callable>
+    [[nodiscard]] auto for_each_index(Callable&& callable)
+    {
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        static_assert(has_room_for<1>, "The stack would grow past the reserved capacity, reserve more values.");
+        check_unknown<N, Table>();
+        using Step = SW<Types..., lua::Unknown>;
+        using Result = std::invoke_result_t<Callable&, Step, lua_Integer>;
+        static_assert(!std::is_void_v<Result>, "The callable must return the wrapper it got.");
+        static_assert(Result::stack_size == stack_size + 1, "The callable must leave the element on the stack.");
+
+        auto size = static_cast<lua_Integer>(lua_rawlen(m_state, index<N>));
+        for (auto i = lua_Integer{1}; i <= size; i++) {
+            record<Operation::GetField>();
+            lua_rawgeti(m_state, index<N>, i);
+            (void)callable(transition<Step>(), i);
+            record<Operation::Pop>();
+            lua_pop(m_state, 1);
+        }
+        return transition<replace_type_t<SW<Types...>, N, Table>>();
+    }
+
+    // Encodes the value at N (with all the tables it contains) as MessagePack and appends it to `sink`, see
+    // lua::MessagePack::encode in lua-cts-msgpack.hpp. The callable receives a lua::MessagePackResult.
+    template <int N, typename Sink, typename Callable, typename Codec = MessagePack>
+    [[nodiscard]] auto tomsgpack(Sink& sink, Callable&& callable, int max_depth = Codec::default_max_depth)
+    {
+        static_assert(stack_size > 0 && toAbsoluteIndex(stack_size, N) >= 1 && toAbsoluteIndex(stack_size, N) <= stack_size, "The selected element is not on the stack.");
+        callable(Codec::encode(m_state, index<N>, sink, max_depth));
+        return transition<SW<Types...>>();
+    }
+
+    // Decodes one MessagePack value. On success `on_success` gets the wrapper with the value pushed, otherwise
+    // `on_error` gets the unchanged wrapper and a lua::MessagePackResult. Both must return the same type.
+    template <typename OnSuccess, typename OnError, typename Codec = MessagePack>
+    auto pushmsgpack(std::string_view bytes, OnSuccess&& on_success, OnError&& on_error, int max_depth = Codec::default_max_depth)
+    {
+        static_assert(has_room_for<1>, "The stack would grow past the reserved capacity, reserve more values.");
+        auto result = Codec::decode(m_state, bytes, max_depth);
+        if (result) {
+            record<Operation::Push>();
+            return on_success(transition<SW<Types..., lua::Unknown>>());
+        }
+        return on_error(transition<SW<Types...>>(), result);
+    }
+
+    // Reads the fields of the table at N into `value` according to `schema`, each value's type is checked exactly once.
+    // Reading stops at the first value with the wrong type. The callable receives a lua::ReadResult saying whether (and
+    // where) that happened, so the fields themselves are read without any exceptions.
+    template <int N, typename Struct, typename... Fields, typename Callable>
+    [[nodiscard]] auto readtable(Struct& value, const Schema<Fields...>& schema, Callable&& callable)
+    {
+        return impl_readtable<false, N>(value, schema, std::forward<Callable>(callable));
+    }
+
+    // Like readtable, but the fields are read with lua_rawget, skipping metamethods.
+    template <int N, typename Struct, typename... Fields, typename Callable>
+    [[nodiscard]] auto rawreadtable(Struct& value, const Schema<Fields...>& schema, Callable&& callable)
+    {
+        return impl_readtable<true, N>(value, schema, std::forward<Callable>(callable));
+    }
+
+    template <typename Callable>
+    [[nodiscard]] auto gettop(Callable&& callable)
+    {
+        callable(lua_gettop(m_state) - m_base);
+        return transition<SW<Types...>>();
+    }
+
+    template <int N>
+    [[nodiscard]] auto setfield(const char* key)
+    {
+        record<Operation::SetField>();
+        static_assert(toAbsoluteIndex(stack_size, N) != stack_size, "Can't use setfield with a table on top of the stack");
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        check_unknown<N, Table>();
+        lua_setfield(m_state, index<N>, key);
+        return transition<pop_back_t<replace_type_t<SW<Types...>, N, Table>, 1>>();
+    }
+
+    template <int N>
+    [[nodiscard]] auto getfield(const char* key)
+    {
+        record<Operation::GetField>();
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        check_unknown<N, Table>();
+        lua_getfield(m_state, index<N>, key);
+        return transition<concat_types_t<replace_type_t<SW<Types...>, N, Table>, SW<lua::Unknown>>>();
+    }
+
+    // Pushes the cached string of `key`.
+    [[nodiscard]] auto pushkey(const Key& key)
+    {
+        record<Operation::Push>();
+        static_assert(has_room_for<2>, "The stack would grow past the reserved capacity, reserve more values.");
+        push_key(m_state, key);
+        return transition<SW<Types..., lua::String>>();
+    }
+
+    // Pushes a copy of the value at N.
+    template <int N>
+    [[nodiscard]] auto pushvalue()
+    {
+        record<Operation::Push>();
+        lua_pushvalue(m_state, index<N>);
+        return transition<SW<Types..., ValueType<N>>>();
+    }
+
+    // Looks up the key on the top of the stack in the table at N without invoking metamethods. The key is replaced by
+    // the value.
+    template <int N>
+    [[nodiscard]] auto rawget()
+    {
+        record<Operation::GetField>();
+        static_assert(toAbsoluteIndex(stack_size, N) != stack_size, "Can't use rawget with a table on top of the stack");
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        check_unknown<N, Table>();
+        lua_rawget(m_state, index<N>);
+        return transition<push_type_t<pop_back_t<replace_type_t<SW<Types...>, N, Table>, 1>, lua::Unknown>>();
+    }
+
+    // Does t[k] = v without invoking metamethods, where t is the table at N, and k and v are the two values on the top of
+    // the stack. Pops both k and v.
+    template <int N>
+    [[nodiscard]] auto rawset()
+    {
+        record<Operation::SetField>();
+        static_assert(toAbsoluteIndex(stack_size, N) < stack_size - 1, "Can't use rawset with a table in the top two values of the stack");
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        check_unknown<N, Table>();
+        lua_rawset(m_state, index<N>);
+        return transition<pop_back_t<replace_type_t<SW<Types...>, N, Table>, 2>>();
+    }
+
+    // rawget with a cached key.
+    template <int N>
+    [[nodiscard]] auto rawgetfield(const Key& key)
+    {
+        record<Operation::GetField>();
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        static_assert(has_room_for<2>, "The stack would grow past the reserved capacity, reserve more values.");
+        check_unknown<N, Table>();
+        push_key(m_state, key);
+        lua_rawget(m_state, index<N> - 1);
+        return transition<push_type_t<replace_type_t<SW<Types...>, N, Table>, lua::Unknown>>();
+    }
+
+    // rawset with a cached key, the value is popped from the top of the stack.
+    template <int N>
+    [[nodiscard]] auto rawsetfield(const Key& key)
+    {
+        record<Operation::SetField>();
+        static_assert(toAbsoluteIndex(stack_size, N) != stack_size, "Can't use rawsetfield with a table on top of the stack");
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        static_assert(has_room_for<2>, "The stack would grow past the reserved capacity, reserve more values.");
+        check_unknown<N, Table>();
+        push_key(m_state, key);
+        lua_insert(m_state, -2);
+        lua_rawset(m_state, index<N> - 1);
+        return transition<pop_back_t<replace_type_t<SW<Types...>, N, Table>, 1>>();
+    }
+
+    template <int N>
+    [[nodiscard]] auto geti(lua_Integer i)
+    {
+        record<Operation::GetField>();
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        check_unknown<N, Table>();
+        lua_geti(m_state, index<N>, i);
+        return transition<push_type_t<replace_type_t<SW<Types...>, N, Table>, lua::Unknown>>();
+    }
+
+    template <int N>
+    [[nodiscard]] auto seti(lua_Integer i)
+    {
+        record<Operation::SetField>();
+        static_assert(toAbsoluteIndex(stack_size, N) != stack_size, "Can't use seti with a table on top of the stack");
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        check_unknown<N, Table>();
+        lua_seti(m_state, index<N>, i);
+        return transition<pop_back_t<replace_type_t<SW<Types...>, N, Table>, 1>>();
+    }
+
+    template <int N>
+    [[nodiscard]] auto rawgeti(lua_Integer i)
+    {
+        record<Operation::GetField>();
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        check_unknown<N, Table>();
+        lua_rawgeti(m_state, index<N>, i);
+        return transition<push_type_t<replace_type_t<SW<Types...>, N, Table>, lua::Unknown>>();
+    }
+
+    template <int N>
+    [[nodiscard]] auto rawseti(lua_Integer i)
+    {
+        record<Operation::SetField>();
+        static_assert(toAbsoluteIndex(stack_size, N) != stack_size, "Can't use rawseti with a table on top of the stack");
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        check_unknown<N, Table>();
+        lua_rawseti(m_state, index<N>, i);
+        return transition<pop_back_t<replace_type_t<SW<Types...>, N, Table>, 1>>();
+    }
+
+    // Pops the value on the top of the stack into `out`, which releases the value it held before. The reference can be
+    // of the value's own type, a type it's known to be (a lua::Integer can be stored in a lua::Ref<lua::Number>), or
+    // lua::Unknown. Unknown values are checked once, here.
+    template <typename T>
+    [[nodiscard]] auto ref(Ref<T>& out)
+    {
+        static_assert(stack_size >= 1, "Can't store a value from an empty stack.");
+        static_assert(is_a_or_unknown_v<ValueType<-1>, T> || std::is_same_v<T, Unknown>, "The value on the top of the stack can't be stored in this reference.");
+        if constexpr (!std::is_same_v<T, Unknown>) {
+            check_unknown<-1, T>();
+        }
+        out = Ref<T>(m_state);
+        return transition<pop_back_t<SW<Types...>, 1>>();
+    }
+
+    // Pushes the referenced value with a single lua_rawgeti. The value keeps the type of the reference, so it isn't
+    // checked. `value` must not be empty.
+    template <typename T>
+    [[nodiscard]] auto pushref(const Ref<T>& value)
+    {
+        record<Operation::Push>();
+        lua_rawgeti(m_state, LUA_REGISTRYINDEX, value.get());
+        return transition<SW<Types..., T>>();
+    }
+
+    // Pops the function on the top of the stack into a prepared call.
+    template <typename Signature, typename CallPolicy>
+    [[nodiscard]] auto prepare(PreparedCall<Signature, CallPolicy>& out)
+    {
+        static_assert(stack_size >= 1, "Can't prepare a call from an empty stack.");
+        static_assert(is_same_or_unknown_v<ValueType<-1>, Function>, "The value on the top of the stack is not a function.");
+        check_unknown<-1, Function>();
+        out = PreparedCall<Signature, CallPolicy>(m_state, Ref<Function>(m_state));
+        return transition<pop_back_t<SW<Types...>, 1>>();
+    }
+
+    template <int N, typename Callable>
+    [[nodiscard]] auto tocfunction(Callable&& callable)
+    {
+        static_assert(is_same_or_unknown_v<ValueType<N>, Function>, "The selected element is not a function.");
+        check_unknown<N, Function>();
+        callable(lua_tocfunction(m_state, index<N>));
+        return transition<replace_type_t<SW<Types...>, N, Function>>();
+    }
+
+    template <int N, typename Callable>
+    [[nodiscard]] auto tostring(Callable&& callable)
+    {
+        static_assert(is_same_or_unknown_v<ValueType<N>, String>, "The selected element is not a string.");
+        check_unknown<N, String>();
+        callable(lua_tostring(m_state, index<N>));
+        return transition<replace_type_t<SW<Types...>, N, String>>();
+    }
+
+    // The string_view points into the Lua string, so it's only valid while the value stays on the stack.
+    template <int N, typename Callable>
+    [[nodiscard]] auto tolstring(Callable&& callable)
+    {
+        static_assert(is_same_or_unknown_v<ValueType<N>, String>, "The selected element is not a string.");
         check_unknown<N, String>();
-        callable(lua_tostring(m_state, N));
-        return replace_type_t<SW<Types...>, N, String>(m_state);
+        std::size_t length;
+        auto str = lua_tolstring(m_state, index<N>, &length);
+        callable(std::string_view(str, length));
+        return transition<replace_type_t<SW<Types...>, N, String>>();
+    }
+
+    // Integers are read without any runtime checks. Other numbers are checked to have an exact integer representation.
+    template <int N, typename Callable>
+    [[nodiscard]] auto tointeger(Callable&& callable)
+    {
+        static_assert(is_a_or_unknown_v<ValueType<N>, Number>, "The selected element is not a number.");
+        if constexpr (std::is_same_v<ValueType<N>, Integer>) {
+            callable(lua_tointeger(m_state, index<N>));
+        } else {
+            check_unknown<N, Number>();
+            int is_integer;
+            auto val = lua_tointegerx(m_state, index<N>, &is_integer);
+            if (!is_integer) {
+                fail(StackError{StackError::Code::NoIntegerRepresentation, 0, 0, toAbsoluteIndex(stack_size, N), Integer::name, LUA_TNUMBER});
+            }
+            callable(val);
+        }
+        return transition<replace_type_t<SW<Types...>, N, refined_t<ValueType<N>, Number>>>();
+    }
+
+    template <int N, typename Callable>
+    [[nodiscard]] auto tonumber(Callable&& callable)
+    {
+        static_assert(is_a_or_unknown_v<ValueType<N>, Number>, "The selected element is not a number.");
+        check_unknown<N, Number>();
+        callable(lua_tonumber(m_state, index<N>));
+        return transition<replace_type_t<SW<Types...>, N, refined_t<ValueType<N>, Number>>>();
+    }
+
+    template <int N, typename Callable>
+    [[nodiscard]] auto toboolean(Callable&& callable)
+    {
+        static_assert(is_same_or_unknown_v<ValueType<N>, Boolean>, "The selected element is not a boolean.");
+        check_unknown<N, Boolean>();
+        callable(static_cast<bool>(lua_toboolean(m_state, index<N>)));
+        return transition<replace_type_t<SW<Types...>, N, Boolean>>();
+    }
+
+    // The callable gets a reference to the T inside the userdata. Values known to hold a T aren't checked, others are
+    // checked by comparing their metatable with the cached one.
+    template <typename T, int N, typename Callable>
+    [[nodiscard]] auto touserdata(Callable&& callable)
+    {
+        static_assert(is_a_or_unknown_v<ValueType<N>, Userdata>, "The selected element is not a full userdata.");
+        if constexpr (!std::is_same_v<ValueType<N>, UserdataOf<T>>) {
+            static_assert(!is_userdata_of_type<ValueType<N>>::value, "The selected element holds a different type.");
+            record<Operation::TypeCheck>();
+            if (!has_type<UserdataOf<T>>(m_state, index<N>)) {
+                fail_wrong_type<N>(UserdataOf<T>::name);
+            }
+        }
+        callable(*static_cast<T*>(lua_touserdata(m_state, index<N>)));
+        return transition<replace_type_t<SW<Types...>, N, UserdataOf<T>>>();
+    }
+
+    template <int N, typename Callable>
+    [[nodiscard]] auto tothread(Callable&& callable)
+    {
+        static_assert(is_same_or_unknown_v<ValueType<N>, Thread>, "The selected element is not a thread.");
+        check_unknown<N, Thread>();
+        callable(lua_tothread(m_state, index<N>));
+        return transition<replace_type_t<SW<Types...>, N, Thread>>();
+    }
+
+    template <int N, typename Callable>
+    [[nodiscard]] auto tolightuserdata(Callable&& callable)
+    {
+        static_assert(is_same_or_unknown_v<ValueType<N>, LightUserdata>, "The selected element is not a light userdata.");
+        check_unknown<N, LightUserdata>();
+        callable(lua_touserdata(m_state, index<N>));
+        return transition<replace_type_t<SW<Types...>, N, LightUserdata>>();
+    }
+
+    template <int N, typename Callable>
+    [[nodiscard]] auto type(Callable&& callable)
+    {
+        callable(ValueType<N>::value);
+        return transition<SW<Types...>>();
+    }
+
+    // Reads the type of an Unknown value once, and calls the handler which takes the wrapper with that value refined to
+    // Nil, Boolean, LightUserdata, Number, String, Table, Function, Userdata or Thread. Handlers are picked by overload
+    // resolution, so a generic lambda can handle the remaining types. Nothing inside a handler checks that value again:
+    // s.visit<1>([] (lua::StackWrapper<lua::String> s) {
+    //     return s.tostring<1>(std::puts).pop<1>();
+    // }, [] (auto s) {
+    //     return s.template pop<1>();
+    // });
+    // Every handler has to return the same type. Values which are already known aren't checked, their handler is called
+    // right away.
+    template <int N, typename... Handlers>
+    [[nodiscard]] auto visit(Handlers&&... handlers)
+    {
+        auto handler = Overloaded<std::decay_t<Handlers>...>{std::forward<Handlers>(handlers)...};
+        if constexpr (!std::is_same_v<ValueType<N>, Unknown>) {
+            return handler(transition<SW<Types...>>());
+        } else {
+            static_assert(handles_all<N, decltype(handler), Nil, Boolean, LightUserdata, Number, String, Table, Function, Userdata, Thread>,
+                "visit() needs a handler for every type of value.");
+            using Result = std::invoke_result_t<decltype(handler)&, replace_type_t<SW<Types...>, N, Nil>>;
+            record<Operation::TypeCheck>();
+            switch (lua_type(m_state, index<N>)) {
+            case LUA_TNIL:
+                return visit_as<N, Nil, Result>(handler);
+            case LUA_TBOOLEAN:
+                return visit_as<N, Boolean, Result>(handler);
+            case LUA_TLIGHTUSERDATA:
+                return visit_as<N, LightUserdata, Result>(handler);
+            case LUA_TNUMBER:
+                return visit_as<N, Number, Result>(handler);
+            case LUA_TSTRING:
+                return visit_as<N, String, Result>(handler);
+            case LUA_TTABLE:
+                return visit_as<N, Table, Result>(handler);
+            case LUA_TFUNCTION:
+                return visit_as<N, Function, Result>(handler);
+            case LUA_TUSERDATA:
+                return visit_as<N, Userdata, Result>(handler);
+            default:
+                return visit_as<N, Thread, Result>(handler);
+            }
+        }
+    }
+
+    // Starts a lua::LazyChain, whose operations are merged before they run.
+    [[nodiscard]] auto lazy()
+    {
+        return LazyChain<SW<Types...>, SW<Types...>>(transition<SW<Types...>>(), std::tuple<>());
+    }
+
+    static constexpr int stack_size = sizeof...(Types);
+
+private:
+    template <typename, template <typename...> typename, typename...>
+    friend class impl_StackWrapper;
+
+    template <typename, typename, typename>
+    friend class LazyChain;
+
+    template <typename>
+    friend class MultiRet;
+
+    impl_StackWrapper(lua_State* state, StackBase base, trusted_t)
+        : m_state(state)
+        , m_base(base.index)
+    {
+        if constexpr (Policy::validate_transitions) {
+            if (auto error = find_stack_error<Types...>(state, m_base)) {
+                fail(error);
+            }
+        }
+        record_stack_size();
+    }
+
+    template <typename Next>
+    [[nodiscard]] auto transition()
+    {
+        static_assert(Policy::capacity < 0 || Next::stack_size <= Policy::capacity, "The stack would grow past the reserved capacity, reserve more values.");
+        return Next(m_state, StackBase{m_base}, trusted_t{});
+    }
+
+    template <typename Struct, typename Member>
+    static int array_size(const Struct&, const Field<Struct, Member>&)
+    {
+        return 0;
+    }
+
+    template <typename Struct, typename Member>
+    static int array_size(const Struct& value, const Elements<Struct, Member>& elements)
+    {
+        return static_cast<int>((value.*elements.member).size());
+    }
+
+    template <typename Struct, typename Member>
+    void store_field(const Struct& value, const Field<Struct, Member>& field)
+    {
+        Value<Member>::push(m_state, value.*field.member);
+        lua_setfield(m_state, -2, field.name);
+    }
+
+    template <typename Struct, typename Member>
+    void store_field(const Struct& value, const Elements<Struct, Member>& elements)
+    {
+        store_sequence(value.*elements.member);
     }
 
-    template <int N, typename Callable>
-    [[nodiscard]] auto tointeger(Callable&& callable)
+    // Stores the elements into the table on the top of the stack, starting at index 1.
+    template <typename Range>
+    void store_sequence(const Range& range)
     {
-        static_assert(is_same_or_unknown_v<ValueType<N>, Number>, "The selected element is not an int.");
-        check_unknown<N, Number>();
-        callable(lua_tointeger(m_state, N));
-        return replace_type_t<SW<Types...>, N, Number>(m_state);
+        auto i = lua_Integer{1};
+        for (const auto& element : range) {
+            Value<std::decay_t<decltype(element)>>::push(m_state, element);
+            lua_rawseti(m_state, -2, i++);
+        }
     }
 
-    template <int N, typename Callable>
-    [[nodiscard]] auto type(Callable&& callable)
+    // Reads `size` elements of the table at `Table`, stopping at the first one with the wrong type.
+    template <int Table, typename Iterator>
+    bool read_sequence(Iterator out, lua_Integer size, ReadResult& result)
     {
-        callable(ValueType<N>::value);
-        return SW<Types...>(m_state);
+        using Element = std::decay_t<decltype(*out)>;
+        for (auto i = lua_Integer{1}; i <= size; i++, ++out) {
+            lua_rawgeti(m_state, Table, i);
+            if (!Value<Element>::read(m_state, -1, *out)) {
+                result = ReadResult{Value<Element>::type::name, nullptr, i, lua_type(m_state, -1)};
+                lua_pop(m_state, 1);
+                return false;
+            }
+            lua_pop(m_state, 1);
+        }
+        return true;
     }
 
-    static constexpr int stack_size = sizeof...(Types);
+    template <bool Raw, int Table, typename Struct, typename Member>
+    bool read_field(Struct& value, const Field<Struct, Member>& field, ReadResult& result)
+    {
+        if constexpr (Raw) {
+            lua_pushstring(m_state, field.name);
+            lua_rawget(m_state, Table - 1);
+        } else {
+            lua_getfield(m_state, Table, field.name);
+        }
 
-private:
+        auto ok = Value<Member>::read(m_state, -1, value.*field.member);
+        if (!ok) {
+            result = ReadResult{Value<Member>::type::name, field.name, 0, lua_type(m_state, -1)};
+        }
+        lua_pop(m_state, 1);
+        return ok;
+    }
+
+    template <bool Raw, int Table, typename Struct, typename Member>
+    bool read_field(Struct& value, const Elements<Struct, Member>& elements, ReadResult& result)
+    {
+        auto& container = value.*elements.member;
+        auto size = static_cast<lua_Integer>(lua_rawlen(m_state, Table));
+        container.resize(static_cast<std::size_t>(size));
+        return read_sequence<Table>(container.begin(), size, result);
+    }
+
+    template <bool Raw, int N, typename Struct, typename... Fields, typename Callable>
+    [[nodiscard]] auto impl_readtable(Struct& value, const Schema<Fields...>& schema, Callable&& callable)
+    {
+        static_assert(is_same_or_unknown_v<ValueType<N>, Table>, "The selected element is not a table.");
+        static_assert(has_room_for<2>, "The stack would grow past the reserved capacity, reserve more values.");
+        check_unknown<N, Table>();
+        auto result = ReadResult{};
+        std::apply([this, &value, &result] (const auto&... fields) {
+            (read_field<Raw, index<N>>(value, fields, result) && ...);
+        }, schema.fields);
+        callable(result);
+        return transition<replace_type_t<SW<Types...>, N, Table>>();
+    }
+
+    // Counting compiles to nothing unless the policy is instrumented.
+    template <Operation Op>
+    void record() const
+    {
+        if constexpr (Policy::instrumented) {
+            ThreadCounters::current().add(Op);
+        }
+    }
+
+    void record_stack_size() const
+    {
+        if constexpr (Policy::instrumented) {
+            ThreadCounters::current().record_stack_size(m_base + stack_size);
+        }
+    }
+
+    // Used by lua::LazyChain, which changes the stack without creating a wrapper for every step. `above` counts values
+    // which were pushed and already consumed.
+    void record_stack_top(int above) const
+    {
+        if constexpr (Policy::instrumented) {
+            ThreadCounters::current().record_stack_size(lua_gettop(m_state) + above);
+        }
+    }
+
+    [[noreturn]] void fail(const StackError& error)
+    {
+        record<Operation::Failure>();
+        Policy::fail(m_state, error);
+    }
+
+    template <int N, typename Handler, typename... Visited>
+    constexpr static bool handles_all = (std::is_invocable_v<Handler&, replace_type_t<SW<Types...>, N, Visited>> && ...);
+
+    template <int N, typename Type, typename Result, typename Handler>
+    Result visit_as(Handler& handler)
+    {
+        using Refined = replace_type_t<SW<Types...>, N, Type>;
+        static_assert(std::is_same_v<std::invoke_result_t<Handler&, Refined>, Result>, "All visit() handlers must return the same type.");
+        return handler(transition<Refined>());
+    }
 
     template<int N, typename Type>
     void check_unknown()
     {
         if constexpr (std::is_same_v<ValueType<N>, Unknown>) {
-            if (lua_type(m_state, N) != Type::value) {
-                throw std::logic_error(std::string("The selected element is not ") + ValueType<N>::name);
+            record<Operation::TypeCheck>();
+            if (!has_type<Type>(m_state, index<N>)) {
+                fail_wrong_type<N>(Type::name);
             }
         }
     }
 
+    template <int N>
+    [[noreturn]] void fail_wrong_type(const char* expected)
+    {
+        fail(StackError{StackError::Code::WrongType, 0, 0, toAbsoluteIndex(stack_size, N), expected, lua_type(m_state, index<N>)});
+    }
+
     template <int N>
     using ValueType = select_type_t<SW<Types...>, toAbsoluteIndex(stack_size, N)>;
 
+    // Whether N more values fit into the reserved capacity. Used by operations which temporarily push more values than
+    // they leave on the stack.
+    template <int N>
+    constexpr static bool has_room_for = Policy::capacity < 0 || stack_size + N <= Policy::capacity;
+
+    // The index passed to the Lua API. Indices are always relative to the top of the stack, so they don't need the base.
+    template <int N>
+    constexpr static int index = toRelativeIndex(stack_size, N);
+
     lua_State* m_state;
+    int m_base;
 };
 
 template <typename... Types>
-class StackWrapper : public impl_StackWrapper<StackWrapper, Types...> {
-    using impl_StackWrapper<StackWrapper, Types...>::impl_StackWrapper;
+class StackWrapper : public impl_StackWrapper<DefaultPolicy, StackWrapper, Types...> {
+    using impl_StackWrapper<DefaultPolicy, StackWrapper, Types...>::impl_StackWrapper;
+
+public:
+    template <typename NewPolicy>
+    using rebind_policy = typename with_policy<NewPolicy>::template StackWrapper<Types...>;
 };
 
 template <>
-class StackWrapper<> : public impl_StackWrapper<StackWrapper> {
+class StackWrapper<> : public impl_StackWrapper<DefaultPolicy, StackWrapper> {
 public:
-    using impl_StackWrapper<StackWrapper>::impl_StackWrapper;
+    using impl_StackWrapper<DefaultPolicy, StackWrapper>::impl_StackWrapper;
+
+    template <typename NewPolicy>
+    using rebind_policy = typename with_policy<NewPolicy>::template StackWrapper<>;
 
     auto pop() = delete; // Can't delete from an empty stack.
     auto tointeger() = delete; // Empty stack has no integers.
@@ -446,5 +2247,496 @@ public:
     auto setfield() = delete; // Can't set field is the stack is empty.
     auto call() = delete; // Can't call if the stack is empty.
 };
+
+// A StackWrapper that only knows about the values on the top of the stack. Everything below them is ignored, so it can be
+// used in C functions and helpers which don't know (or care) what their caller left on the stack. Only the window is
+// checked when it's created:
+// lua::StackWindow<lua::Table, lua::String>(state) // The table and the string are the top two values.
+template <typename... Types>
+class StackWindow : public impl_StackWrapper<DefaultPolicy, StackWindow, Types...> {
+public:
+    using impl_StackWrapper<DefaultPolicy, StackWindow, Types...>::impl_StackWrapper;
+
+    template <typename NewPolicy>
+    using rebind_policy = typename with_policy<NewPolicy>::template StackWindow<Types...>;
+
+    StackWindow(lua_State* state)
+        : impl_StackWrapper<DefaultPolicy, StackWindow, Types...>(state, StackBase{lua_gettop(state) - int{sizeof...(Types)}})
+    {
+    }
+
+    using impl_StackWrapper<DefaultPolicy, StackWindow, Types...>::try_create;
+
+    template <typename OnSuccess, typename OnError>
+    static auto try_create(lua_State* state, OnSuccess&& on_success, OnError&& on_error)
+    {
+        return try_create(state, StackBase{lua_gettop(state) - int{sizeof...(Types)}}, std::forward<OnSuccess>(on_success), std::forward<OnError>(on_error));
+    }
+};
+
+// StackWrapper with a user-selected policy:
+// lua::with_policy<lua::ParanoidPolicy>::StackWrapper<lua::Number>(state)
+template <typename Policy>
+struct with_policy {
+    template <typename... Types>
+    class StackWrapper : public impl_StackWrapper<Policy, StackWrapper, Types...> {
+        using impl_StackWrapper<Policy, StackWrapper, Types...>::impl_StackWrapper;
+
+    public:
+        template <typename NewPolicy>
+        using rebind_policy = typename with_policy<NewPolicy>::template StackWrapper<Types...>;
+    };
+
+    template <typename... Types>
+    class StackWindow : public impl_StackWrapper<Policy, StackWindow, Types...> {
+    public:
+        using impl_StackWrapper<Policy, StackWindow, Types...>::impl_StackWrapper;
+
+        template <typename NewPolicy>
+        using rebind_policy = typename with_policy<NewPolicy>::template StackWindow<Types...>;
+
+        StackWindow(lua_State* state)
+            : impl_StackWrapper<Policy, StackWindow, Types...>(state, StackBase{lua_gettop(state) - int{sizeof...(Types)}})
+        {
+        }
+
+        using impl_StackWrapper<Policy, StackWindow, Types...>::try_create;
+
+        template <typename OnSuccess, typename OnError>
+        static auto try_create(lua_State* state, OnSuccess&& on_success, OnError&& on_error)
+        {
+            return try_create(state, StackBase{lua_gettop(state) - int{sizeof...(Types)}}, std::forward<OnSuccess>(on_success), std::forward<OnError>(on_error));
+        }
+    };
+};
+
+// Operations recorded by a lua::LazyChain. Indices are relative to the top of the stack at the point where the
+// operation runs.
+template <int N>
+struct PopOp {
+    constexpr static Operation operation = Operation::Pop;
+    constexpr static bool pure_push = false;
+    constexpr static int count = N;
+
+    void operator()(lua_State* state) const
+    {
+        lua_pop(state, N);
+    }
+};
+
+template <int Index, int N>
+struct RotateOp {
+    constexpr static Operation operation = Operation::Rotate;
+    constexpr static bool pure_push = false;
+    constexpr static int index = Index;
+    constexpr static int count = N;
+
+    void operator()(lua_State* state) const
+    {
+        lua_rotate(state, Index, N);
+    }
+};
+
+// Pushes that have no side effects, so a pop right after them cancels them out.
+template <typename T>
+struct PushOp {
+    constexpr static Operation operation = Operation::Push;
+    constexpr static bool pure_push = true;
+
+    T value;
+
+    void operator()(lua_State* state) const
+    {
+        Value<T>::push(state, value);
+    }
+};
+
+struct PushNilOp {
+    constexpr static Operation operation = Operation::Push;
+    constexpr static bool pure_push = true;
+
+    void operator()(lua_State* state) const
+    {
+        lua_pushnil(state);
+    }
+};
+
+template <int Index>
+struct PushValueOp {
+    constexpr static Operation operation = Operation::Push;
+    constexpr static bool pure_push = true;
+
+    void operator()(lua_State* state) const
+    {
+        lua_pushvalue(state, Index);
+    }
+};
+
+template <int Index>
+struct SetFieldOp {
+    constexpr static Operation operation = Operation::SetField;
+    constexpr static bool pure_push = false;
+
+    const char* key;
+
+    void operator()(lua_State* state) const
+    {
+        lua_setfield(state, Index, key);
+    }
+};
+
+template <int Index>
+struct RawSetIOp {
+    constexpr static Operation operation = Operation::SetField;
+    constexpr static bool pure_push = false;
+
+    lua_Integer i;
+
+    void operator()(lua_State* state) const
+    {
+        lua_rawseti(state, Index, i);
+    }
+};
+
+// A push and the store which takes the pushed value, recorded as one operation. Lua has no call which does both, so
+// they still run back to back, but the pair leaves the stack as it was and never needs an intermediate wrapper.
+template <typename Push, typename Store>
+struct StoreOp {
+    constexpr static Operation push_operation = Push::operation;
+    constexpr static Operation operation = Store::operation;
+    constexpr static bool pure_push = false;
+
+    Push push;
+    Store store;
+
+    void operator()(lua_State* state) const
+    {
+        push(state);
+        store(state);
+    }
+};
+
+template <typename T>
+struct is_table_store : std::false_type {
+};
+
+template <int Index>
+struct is_table_store<SetFieldOp<Index>> : std::true_type {
+};
+
+template <int Index>
+struct is_table_store<RawSetIOp<Index>> : std::true_type {
+};
+
+template <typename T>
+struct is_store_op : std::false_type {
+};
+
+template <typename Push, typename Store>
+struct is_store_op<StoreOp<Push, Store>> : std::true_type {
+};
+
+template <typename T>
+struct is_pop_op : std::false_type {
+};
+
+template <int N>
+struct is_pop_op<PopOp<N>> : std::true_type {
+};
+
+template <typename T>
+struct is_rotate_op : std::false_type {
+};
+
+template <int Index, int N>
+struct is_rotate_op<RotateOp<Index, N>> : std::true_type {
+};
+
+template <typename A, typename B>
+constexpr bool rotate_same_window()
+{
+    if constexpr (is_rotate_op<A>::value && is_rotate_op<B>::value) {
+        return A::index == B::index;
+    } else {
+        return false;
+    }
+}
+
+template <std::size_t... Is, typename... Ops>
+auto tuple_prefix(const std::tuple<Ops...>& ops, std::index_sequence<Is...>)
+{
+    return std::tuple<std::tuple_element_t<Is, std::tuple<Ops...>>...>(std::get<Is>(ops)...);
+}
+
+// Appends `op` to `ops`, merging it with the last operation where possible:
+// - pops of zero values are dropped
+// - adjacent pops become a single pop
+// - a pop right after a push removes the push
+// - rotations of the same window add up, modulo the window size, and disappear when they cancel out
+// - a push followed by a table store becomes a single lua::StoreOp
+template <typename... Ops, typename Op>
+auto append_op(const std::tuple<Ops...>& ops, const Op& op)
+{
+    if constexpr (std::is_same_v<Op, PopOp<0>>) {
+        return ops;
+    } else if constexpr (sizeof...(Ops) == 0) {
+        return std::tuple<Op>(op);
+    } else {
+        using Last = std::tuple_element_t<sizeof...(Ops) - 1, std::tuple<Ops...>>;
+        auto init = [&ops] { return tuple_prefix(ops, std::make_index_sequence<sizeof...(Ops) - 1>()); };
+        if constexpr (is_pop_op<Op>::value && is_pop_op<Last>::value) {
+            return append_op(init(), PopOp<Last::count + Op::count>{});
+        } else if constexpr (is_pop_op<Op>::value && Last::pure_push) {
+            if constexpr (Op::count == 1) {
+                return init();
+            } else {
+                return append_op(init(), PopOp<Op::count - 1>{});
+            }
+        } else if constexpr (is_table_store<Op>::value && Last::pure_push) {
+            return std::tuple_cat(init(), std::tuple<StoreOp<Last, Op>>(StoreOp<Last, Op>{std::get<sizeof...(Ops) - 1>(ops), op}));
+        } else if constexpr (rotate_same_window<Last, Op>()) {
+            constexpr auto count = (Last::count + Op::count) % -Op::index;
+            if constexpr (count == 0) {
+                return init();
+            } else {
+                return std::tuple_cat(init(), std::tuple<RotateOp<Op::index, count>>());
+            }
+        } else {
+            return std::tuple_cat(ops, std::tuple<Op>(op));
+        }
+    }
+}
+
+// A chain of stack operations which only runs when run() is called, so that redundant operations can be merged first
+// (see append_op). Every operation is checked in compile time exactly like its StackWrapper counterpart, and run()
+// returns the same wrapper the eager chain would have produced:
+// auto s2 = s.lazy().rotate<-2, 1>().rotate<-2, 1>().pushinteger(1).pop<1>().pop<1>().run(); // A single lua_pop.
+// Only operations which never check anything at runtime are available, tables written to must be known to be tables.
+template <typename Start, typename Current, typename Ops>
+class LazyChain {
+public:
+    LazyChain(Start start, Ops ops)
+        : m_start(start)
+        , m_ops(std::move(ops))
+    {
+    }
+
+    template <int N>
+    [[nodiscard]] auto pop()
+    {
+        return append<decltype(std::declval<Current&>().template pop<N>())>(PopOp<N>{});
+    }
+
+    template <int IDX, int N>
+    [[nodiscard]] auto rotate()
+    {
+        using Next = decltype(std::declval<Current&>().template rotate<IDX, N>());
+        constexpr auto index = toRelativeIndex(Current::stack_size, IDX);
+        // Rotations are normalized, so that rotating by -1 and by the window size - 1 merge the same way.
+        constexpr auto count = (N % -index - index) % -index;
+        if constexpr (count == 0) {
+            return LazyChain<Start, Next, Ops>(m_start, m_ops);
+        } else {
+            return append<Next>(RotateOp<index, count>{});
+        }
+    }
+
+    template <int IDX>
+    [[nodiscard]] auto insert()
+    {
+        return rotate<IDX, 1>();
+    }
+
+    [[nodiscard]] auto pushinteger(lua_Integer val)
+    {
+        return append<decltype(std::declval<Current&>().pushinteger(val))>(PushOp<lua_Integer>{val});
+    }
+
+    [[nodiscard]] auto pushnumber(lua_Number val)
+    {
+        return append<decltype(std::declval<Current&>().pushnumber(val))>(PushOp<lua_Number>{val});
+    }
+
+    [[nodiscard]] auto pushboolean(bool val)
+    {
+        return append<decltype(std::declval<Current&>().pushboolean(val))>(PushOp<bool>{val});
+    }
+
+    [[nodiscard]] auto pushstring(const char* val)
+    {
+        return append<decltype(std::declval<Current&>().pushstring(val))>(PushOp<const char*>{val});
+    }
+
+    // The string must outlive the chain.
+    [[nodiscard]] auto pushlstring(std::string_view val)
+    {
+        return append<decltype(std::declval<Current&>().pushlstring(val))>(PushOp<std::string_view>{val});
+    }
+
+    template <std::size_t Length>
+    [[nodiscard]] auto pushliteral(const char (&val)[Length])
+    {
+        return append<decltype(std::declval<Current&>().pushliteral(val))>(PushOp<std::string_view>{std::string_view(val, Length - 1)});
+    }
+
+    [[nodiscard]] auto pushnil()
+    {
+        return append<decltype(std::declval<Current&>().pushnil())>(PushNilOp{});
+    }
+
+    template <int N>
+    [[nodiscard]] auto pushvalue()
+    {
+        return append<decltype(std::declval<Current&>().template pushvalue<N>())>(PushValueOp<toRelativeIndex(Current::stack_size, N)>{});
+    }
+
+    template <int N>
+    [[nodiscard]] auto setfield(const char* key)
+    {
+        static_assert(std::is_same_v<select_type_t<Current, toAbsoluteIndex(Current::stack_size, N)>, Table>, "Lazy chains can only write to values known to be tables.");
+        return append<decltype(std::declval<Current&>().template setfield<N>(key))>(SetFieldOp<toRelativeIndex(Current::stack_size, N)>{key});
+    }
+
+    template <int N>
+    [[nodiscard]] auto rawseti(lua_Integer i)
+    {
+        static_assert(std::is_same_v<select_type_t<Current, toAbsoluteIndex(Current::stack_size, N)>, Table>, "Lazy chains can only write to values known to be tables.");
+        return append<decltype(std::declval<Current&>().template rawseti<N>(i))>(RawSetIOp<toRelativeIndex(Current::stack_size, N)>{i});
+    }
+
+    // Runs the merged operations in one pass.
+    [[nodiscard]] Current run()
+    {
+        std::apply([this] (const auto&... ops) {
+            (execute(ops), ...);
+        }, m_ops);
+        return m_start.template transition<Current>();
+    }
+
+    // How many operations are left after merging. A lua::StoreOp counts once, but makes two Lua API calls.
+    constexpr static std::size_t operation_count = std::tuple_size_v<Ops>;
+
+private:
+    template <typename Next, typename Op>
+    auto append(const Op& op)
+    {
+        auto ops = append_op(m_ops, op);
+        return LazyChain<Start, Next, decltype(ops)>(m_start, std::move(ops));
+    }
+
+    template <typename Op>
+    void execute(const Op& op)
+    {
+        if constexpr (is_store_op<Op>::value) {
+            m_start.template record<Op::push_operation>();
+        }
+        m_start.template record<Op::operation>();
+        op(m_start.m_state);
+        m_start.record_stack_top(is_store_op<Op>::value ? 1 : 0);
+    }
+
+    Start m_start;
+    Ops m_ops;
+};
+
+template <typename T>
+struct function_traits;
+
+template <typename R, typename... Args>
+struct function_traits<R (*)(Args...)> {
+    using result_type = R;
+    using args_type = std::tuple<std::decay_t<Args>...>;
+};
+
+template <typename R, typename... Args>
+struct function_traits<R (*)(Args...) noexcept> : function_traits<R (*)(Args...)> {
+};
+
+template <typename T>
+void push_results(lua_State* state, const T& value)
+{
+    Value<T>::push(state, value);
+}
+
+template <typename... Ts>
+void push_results(lua_State* state, const std::tuple<Ts...>& values)
+{
+    std::apply([state] (const auto&... value) {
+        (Value<std::decay_t<decltype(value)>>::push(state, value), ...);
+    }, values);
+}
+
+template <typename T>
+bool read_arg(lua_State* state, int index, T& out, ReadResult& result)
+{
+    if (!Value<T>::read(state, index, out)) {
+        result = ReadResult{Value<T>::type::name, nullptr, index, lua_type(state, index)};
+        return false;
+    }
+    return true;
+}
+
+template <typename... Args, std::size_t... Is>
+bool read_args(lua_State* state, std::tuple<Args...>& args, ReadResult& result, std::index_sequence<Is...>)
+{
+    return (read_arg(state, static_cast<int>(Is) + 1, std::get<Is>(args), result) && ...);
+}
+
+// Returns the number of results, or -1 with an error message pushed on the stack. Raising the Lua error is left to the
+// caller, because lua_error longjmps and would skip the destructors of the arguments.
+template <auto Function>
+int impl_bound_function(lua_State* state)
+{
+    using traits = function_traits<decltype(Function)>;
+    using args_type = typename traits::args_type;
+    using result_type = typename traits::result_type;
+    constexpr auto nargs = int{std::tuple_size_v<args_type>};
+    static_assert(result_count<result_type>::value <= LUA_MINSTACK, "Lua only guarantees LUA_MINSTACK free slots for the results.");
+
+    if (auto got = lua_gettop(state); got != nargs) {
+        lua_pushfstring(state, "wrong number of arguments (expected %d, got %d)", nargs, got);
+        return -1;
+    }
+
+    try {
+        auto args = args_type{};
+        auto result = ReadResult{};
+        if (!read_args(state, args, result, std::make_index_sequence<nargs>{})) {
+            lua_pushfstring(state, "bad argument #%d (expected %s, got %s)", static_cast<int>(result.index), result.expected, lua_typename(state, result.got));
+            return -1;
+        }
+
+        if constexpr (std::is_void_v<result_type>) {
+            std::apply(Function, std::move(args));
+        } else {
+            push_results(state, std::apply(Function, std::move(args)));
+        }
+        return result_count<result_type>::value;
+    } catch (const std::exception& ex) {
+        lua_pushstring(state, ex.what());
+    } catch (...) {
+        lua_pushliteral(state, "unknown C++ exception");
+    }
+    return -1;
 }
 
+template <auto Function>
+int bound_function(lua_State* state)
+{
+    if (auto results = impl_bound_function<Function>(state); results >= 0) {
+        return results;
+    }
+
+    return lua_error(state);
+}
+
+// Generates a lua_CFunction calling a C++ function. The arguments are checked once and converted straight to the
+// function's parameters, the return value is pushed as the result (std::tuple is returned as multiple results). Wrong
+// arguments and C++ exceptions are raised as Lua errors:
+// lua::StackWrapper<>(state).pushcfunction(lua::bind<&add>());
+template <auto Function>
+constexpr lua_CFunction bind()
+{
+    return &bound_function<Function>;
+}
+}
@@ -0,0 +1,134 @@
+#include <doctest/doctest.h>
+#include <limits>
+#include <memory>
+#include <numeric>
+
+#include <lua-cts-alloc.hpp>
+
+namespace {
+using StatePtr = std::unique_ptr<lua_State, decltype(&lua_close)>;
+
+int run(lua_State* state, const char* code)
+{
+    if (auto status = luaL_loadstring(state, code); status != LUA_OK) {
+        return status;
+    }
+    return lua_pcall(state, 0, 0, 0);
+}
+
+std::uint64_t total_allocations(const lua::AllocatorStats& stats)
+{
+    return std::accumulate(stats.allocations.begin(), stats.allocations.end(), std::uint64_t{0});
+}
+}
+
+TEST_CASE("allocator")
+{
+    DOCTEST_SUBCASE("Free lists")
+    {
+        auto allocator = lua::Allocator();
+        {
+            auto state = StatePtr(allocator.newstate(), lua_close);
+            REQUIRE(state);
+            REQUIRE(run(state.get(), "local t = {} for i = 1, 1000 do t[i] = {i} end") == LUA_OK);
+
+            const auto& stats = allocator.stats();
+            REQUIRE(stats.live_bytes > 0);
+            REQUIRE(stats.peak_bytes >= stats.live_bytes);
+            REQUIRE(stats.reserved_bytes >= stats.live_bytes);
+            REQUIRE(total_allocations(stats) > 1000);
+            REQUIRE(stats.refused == 0);
+        }
+        REQUIRE(allocator.stats().live_bytes == 0);
+    }
+
+    DOCTEST_SUBCASE("Arena")
+    {
+        auto allocator = lua::Allocator(lua::Allocator::Mode::Arena);
+        {
+            auto state = StatePtr(allocator.newstate(), lua_close);
+            REQUIRE(state);
+            REQUIRE(run(state.get(), "local s = '' for i = 1, 100 do s = s .. i end") == LUA_OK);
+        }
+        // Everything was freed, but the memory is only given back when the allocator is destroyed.
+        REQUIRE(allocator.stats().live_bytes == 0);
+        REQUIRE(allocator.stats().reserved_bytes > 0);
+    }
+
+    DOCTEST_SUBCASE("Shrinking")
+    {
+        auto fill = [] (void* block, std::size_t size) {
+            auto bytes = static_cast<unsigned char*>(block);
+            for (auto i = std::size_t{0}; i < size; i++) {
+                bytes[i] = static_cast<unsigned char>(i);
+            }
+        };
+        auto filled = [] (void* block, std::size_t size) {
+            auto bytes = static_cast<unsigned char*>(block);
+            for (auto i = std::size_t{0}; i < size; i++) {
+                if (bytes[i] != static_cast<unsigned char>(i)) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        // Arena blocks stay where they are, the last one grows and shrinks in place.
+        auto arena = lua::Allocator(lua::Allocator::Mode::Arena);
+        auto first = lua::Allocator::allocate(&arena, nullptr, LUA_TTABLE, 200);
+        auto last = lua::Allocator::allocate(&arena, nullptr, LUA_TTABLE, 200);
+        fill(first, 200);
+        fill(last, 200);
+        auto reserved = arena.stats().reserved_bytes;
+        REQUIRE(lua::Allocator::allocate(&arena, first, 200, 8) == first);
+        REQUIRE(lua::Allocator::allocate(&arena, last, 200, 8) == last);
+        REQUIRE(lua::Allocator::allocate(&arena, last, 8, 300) == last);
+        REQUIRE(filled(first, 8));
+        REQUIRE(filled(last, 8));
+        REQUIRE(arena.stats().reserved_bytes == reserved);
+        REQUIRE(arena.stats().live_bytes == 308);
+
+        // Shrinking a block to another size class isn't refused, even when the memory limit is reached.
+        auto pooled = lua::Allocator(lua::Allocator::Mode::FreeList, 1000);
+        auto large = lua::Allocator::allocate(&pooled, nullptr, LUA_TSTRING, 1000);
+        REQUIRE(large);
+        fill(large, 1000);
+        REQUIRE(lua::Allocator::allocate(&pooled, nullptr, LUA_TSTRING, 8) == nullptr);
+        auto small = lua::Allocator::allocate(&pooled, large, 1000, 100);
+        REQUIRE(small);
+        REQUIRE(filled(small, 100));
+        auto smaller = lua::Allocator::allocate(&pooled, small, 100, 8);
+        REQUIRE(smaller);
+        REQUIRE(filled(smaller, 8));
+        REQUIRE(pooled.stats().live_bytes == 8);
+        REQUIRE(lua::Allocator::allocate(&pooled, smaller, 8, 0) == nullptr);
+        REQUIRE(pooled.stats().live_bytes == 0);
+
+        // Chunks this big can't be allocated, so a large block shrunk to a small size class has to stay where it is. It
+        // then belongs to the allocator like a chunk, and is reused from the free list.
+        auto starved = lua::Allocator(lua::Allocator::Mode::FreeList, 0, std::numeric_limits<std::size_t>::max() / 4);
+        auto kept = lua::Allocator::allocate(&starved, nullptr, LUA_TSTRING, 1000);
+        REQUIRE(kept);
+        fill(kept, 1000);
+        REQUIRE(lua::Allocator::allocate(&starved, kept, 1000, 100) == kept);
+        REQUIRE(filled(kept, 100));
+        REQUIRE(lua::Allocator::allocate(&starved, kept, 100, 0) == nullptr);
+        REQUIRE(lua::Allocator::allocate(&starved, nullptr, LUA_TSTRING, 100) == kept);
+        REQUIRE(starved.stats().reserved_bytes == 1000);
+    }
+
+    DOCTEST_SUBCASE("Memory limit")
+    {
+        constexpr auto limit = std::size_t{256 * 1024};
+        auto allocator = lua::Allocator(lua::Allocator::Mode::FreeList, limit);
+        auto state = StatePtr(allocator.newstate(), lua_close);
+        REQUIRE(state);
+        REQUIRE(run(state.get(), "local t = {} for i = 1, 1000000 do t[i] = i end") == LUA_ERRMEM);
+        lua_settop(state.get(), 0);
+        REQUIRE(allocator.stats().refused > 0);
+        REQUIRE(allocator.stats().peak_bytes <= limit);
+
+        // The state is still usable.
+        REQUIRE(run(state.get(), "local t = {1, 2, 3}") == LUA_OK);
+    }
+}
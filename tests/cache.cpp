@@ -0,0 +1,109 @@
+#include <doctest/doctest.h>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include <unistd.h>
+
+#include <lua-cts-cache.hpp>
+
+namespace {
+// Loads `source` through the cache and returns the result of calling the chunk, or the error message.
+std::string run(lua::BytecodeCache& cache, lua_State* state, std::string_view source)
+{
+    auto result = std::string();
+    auto s = cache.load(lua::StackWrapper<>(state), source, "=test", [&result] (auto s) {
+        return s.template call<0, 1>().template tostring<1>([&result] (const char* x) { result = x; }).template pop<1>();
+    }, [&result] (auto s) {
+        return s.template tostring<1>([&result] (const char* x) { result = x; }).template pop<1>();
+    });
+    static_assert(std::is_same_v<decltype(s), lua::StackWrapper<>>);
+    return result;
+}
+}
+
+TEST_CASE("bytecode cache")
+{
+    auto directory = std::filesystem::temp_directory_path() / ("lua-cts-cache-" + std::to_string(::getpid()));
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    auto state = std::unique_ptr<lua_State, decltype(&lua_close)>(luaL_newstate(), lua_close);
+    auto cache = lua::BytecodeCache(directory);
+
+    auto entries = [&directory] {
+        auto count = 0;
+        for ([[maybe_unused]] const auto& entry : std::filesystem::directory_iterator(directory)) {
+            count++;
+        }
+        return count;
+    };
+
+    DOCTEST_SUBCASE("Chunks are compiled once")
+    {
+        REQUIRE(run(cache, state.get(), "return 'first'") == "first");
+        REQUIRE(cache.stats().misses == 1);
+        REQUIRE(cache.stats().hits == 0);
+        REQUIRE(entries() == 1);
+
+        // A new state (or process) finds the compiled chunk.
+        auto other = std::unique_ptr<lua_State, decltype(&lua_close)>(luaL_newstate(), lua_close);
+        REQUIRE(run(cache, other.get(), "return 'first'") == "first");
+        REQUIRE(cache.stats().hits == 1);
+        REQUIRE(cache.stats().misses == 1);
+
+        REQUIRE(run(cache, state.get(), "return 'second'") == "second");
+        REQUIRE(cache.stats().misses == 2);
+        REQUIRE(entries() == 2);
+        REQUIRE(cache.stats().write_failures == 0);
+        REQUIRE(lua_gettop(state.get()) == 0);
+    }
+
+    DOCTEST_SUBCASE("Broken entries are replaced")
+    {
+        REQUIRE(run(cache, state.get(), "return 'value'") == "value");
+        for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+            std::ofstream(entry.path(), std::ios::binary | std::ios::trunc) << "not bytecode";
+        }
+
+        REQUIRE(run(cache, state.get(), "return 'value'") == "value");
+        REQUIRE(cache.stats().rejected == 1);
+        REQUIRE(run(cache, state.get(), "return 'value'") == "value");
+        REQUIRE(cache.stats().hits == 1);
+    }
+
+    DOCTEST_SUBCASE("Entries of other sources aren't used")
+    {
+        REQUIRE(run(cache, state.get(), "return 'first'") == "first");
+        auto first = *std::filesystem::directory_iterator(directory);
+        REQUIRE(run(cache, state.get(), "return 'second'") == "second");
+
+        // The entry of the second chunk now holds the first one, as if their hashes collided.
+        for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+            if (entry.path() != first.path()) {
+                std::filesystem::copy_file(first.path(), entry.path(), std::filesystem::copy_options::overwrite_existing);
+            }
+        }
+        REQUIRE(run(cache, state.get(), "return 'second'") == "second");
+        REQUIRE(cache.stats().rejected == 1);
+        REQUIRE(run(cache, state.get(), "return 'second'") == "second");
+        REQUIRE(cache.stats().hits == 1);
+        REQUIRE(run(cache, state.get(), "return 'first'") == "first");
+        REQUIRE(cache.stats().hits == 2);
+    }
+
+    DOCTEST_SUBCASE("Syntax errors")
+    {
+        REQUIRE(run(cache, state.get(), "return (").find("test") != std::string::npos);
+        REQUIRE(entries() == 0);
+    }
+
+    DOCTEST_SUBCASE("Unwritable directory")
+    {
+        auto missing = lua::BytecodeCache(directory / "missing");
+        REQUIRE(run(missing, state.get(), "return 'value'") == "value");
+        REQUIRE(missing.stats().write_failures == 1);
+    }
+
+    std::filesystem::remove_all(directory);
+}
@@ -0,0 +1,140 @@
+#include <doctest/doctest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <lua-cts-msgpack.hpp>
+
+namespace {
+// Encodes the result of `code`.
+std::string encode(lua_State* state, const char* code, lua::MessagePackResult::Code expected = lua::MessagePackResult::Code::None)
+{
+    REQUIRE(luaL_loadstring(state, code) == LUA_OK);
+    auto bytes = std::string();
+    auto s = lua::StackWrapper<lua::Function>(state).call<0, 1>().tomsgpack<1>(bytes, [expected] (lua::MessagePackResult result) {
+        REQUIRE(result.code == expected);
+    }).pop<1>();
+    static_assert(std::is_same_v<decltype(s), lua::StackWrapper<>>);
+    return bytes;
+}
+
+// Decodes `bytes`, and passes the value to the Lua function `check`, which must return true.
+void decode(lua_State* state, std::string_view bytes, const char* check)
+{
+    REQUIRE(luaL_loadstring(state, check) == LUA_OK);
+    auto s = lua::StackWrapper<lua::Function>(state).pushmsgpack(bytes, [] (auto s) {
+        return s.template call<1, 1>().template toboolean<1>([] (bool ok) { REQUIRE(ok); }).template pop<1>();
+    }, [] (auto s, lua::MessagePackResult result) {
+        FAIL(result.message());
+        return s.template pop<1>();
+    });
+    static_assert(std::is_same_v<decltype(s), lua::StackWrapper<>>);
+}
+
+lua::MessagePackResult decode_error(lua_State* state, std::string_view bytes, int max_depth = lua::MessagePack::default_max_depth)
+{
+    auto error = lua::MessagePackResult{};
+    auto s = lua::StackWrapper<>(state).pushmsgpack(bytes, [] (auto s) {
+        FAIL("The data should have been rejected");
+        return s.template pop<1>();
+    }, [&error] (auto s, lua::MessagePackResult result) {
+        error = result;
+        return s;
+    }, max_depth);
+    static_assert(std::is_same_v<decltype(s), lua::StackWrapper<>>);
+    REQUIRE(lua_gettop(state) == 0);
+    return error;
+}
+
+std::string bytes(std::initializer_list<unsigned char> values)
+{
+    return std::string(values.begin(), values.end());
+}
+}
+
+TEST_CASE("MessagePack")
+{
+    auto state = std::unique_ptr<lua_State, decltype(&lua_close)>(luaL_newstate(), lua_close);
+    luaL_openlibs(state.get());
+
+    DOCTEST_SUBCASE("Scalars use the shortest encoding")
+    {
+        REQUIRE(encode(state.get(), "return nil") == bytes({0xc0}));
+        REQUIRE(encode(state.get(), "return true") == bytes({0xc3}));
+        REQUIRE(encode(state.get(), "return 5") == bytes({0x05}));
+        REQUIRE(encode(state.get(), "return -3") == bytes({0xfd}));
+        REQUIRE(encode(state.get(), "return 200") == bytes({0xcc, 0xc8}));
+        REQUIRE(encode(state.get(), "return -200") == bytes({0xd1, 0xff, 0x38}));
+        REQUIRE(encode(state.get(), "return 65536") == bytes({0xce, 0x00, 0x01, 0x00, 0x00}));
+        REQUIRE(encode(state.get(), "return 1.5") == bytes({0xcb, 0x3f, 0xf8, 0, 0, 0, 0, 0, 0}));
+        REQUIRE(encode(state.get(), "return 'abc'") == bytes({0xa3, 'a', 'b', 'c'}));
+        REQUIRE(encode(state.get(), "return string.rep('x', 40)").substr(0, 2) == bytes({0xd9, 40}));
+    }
+
+    DOCTEST_SUBCASE("Tables")
+    {
+        REQUIRE(encode(state.get(), "return {1, 2}") == bytes({0x92, 0x01, 0x02}));
+        REQUIRE(encode(state.get(), "return {a = 1}") == bytes({0x81, 0xa1, 'a', 0x01}));
+        // Keys which aren't exactly 1 to #t make a map.
+        REQUIRE(encode(state.get(), "return {1, 2, x = 3}")[0] == static_cast<char>(0x83));
+        REQUIRE(encode(state.get(), "return {[2] = 1}") == bytes({0x81, 0x02, 0x01}));
+    }
+
+    DOCTEST_SUBCASE("Round trip")
+    {
+        auto encoded = encode(state.get(), "return {1, 'two', {x = 3.5, y = {true, false}}, big = 1 << 40, neg = -100000, s = string.rep('s', 300)}");
+        decode(state.get(), encoded, R"(local t = ...
+            return t[1] == 1 and t[2] == 'two' and t[3].x == 3.5 and t[3].y[1] == true and t[3].y[2] == false
+                and t.big == 1 << 40 and math.type(t.big) == 'integer' and t.neg == -100000 and #t.s == 300)");
+
+        auto sequence = encode(state.get(), "local t = {} for i = 1, 1000 do t[i] = i * 2 end return t");
+        REQUIRE(sequence.substr(0, 3) == bytes({0xdc, 0x03, 0xe8}));
+        decode(state.get(), sequence, "local t = ... return #t == 1000 and t[1000] == 2000");
+    }
+
+    DOCTEST_SUBCASE("Callable sinks")
+    {
+        REQUIRE(luaL_loadstring(state.get(), "return {string.rep('a', 1000), 1, 2, 3}") == LUA_OK);
+        auto pieces = std::vector<std::string>();
+        auto sink = [&pieces] (std::string_view piece) { pieces.emplace_back(piece); };
+        auto buffer = std::vector<unsigned char>();
+        auto s = lua::StackWrapper<lua::Function>(state.get()).call<0, 1>()
+            .tomsgpack<1>(sink, [] (lua::MessagePackResult result) { REQUIRE(result); })
+            .tomsgpack<-1>(buffer, [] (lua::MessagePackResult result) { REQUIRE(result); });
+        static_assert(std::is_same_v<decltype(s), lua::StackWrapper<lua::Unknown>>);
+
+        auto joined = std::string();
+        for (const auto& piece : pieces) {
+            joined += piece;
+        }
+        REQUIRE(joined == std::string(buffer.begin(), buffer.end()));
+        REQUIRE(pieces.size() > 1);
+    }
+
+    DOCTEST_SUBCASE("Encoding errors")
+    {
+        encode(state.get(), "return print", lua::MessagePackResult::Code::UnsupportedType);
+        encode(state.get(), "local t = {} t.self = t return t", lua::MessagePackResult::Code::Cycle);
+        encode(state.get(), "local t = {} for i = 1, 40 do t = {t} end return t", lua::MessagePackResult::Code::TooDeep);
+        // Shared tables which don't form a cycle are fine.
+        encode(state.get(), "local shared = {} return {shared, shared}");
+        REQUIRE(lua_gettop(state.get()) == 0);
+    }
+
+    DOCTEST_SUBCASE("Decoding errors")
+    {
+        REQUIRE(decode_error(state.get(), "").code == lua::MessagePackResult::Code::Truncated);
+        REQUIRE(decode_error(state.get(), bytes({0x92, 0x01})).code == lua::MessagePackResult::Code::Truncated);
+        REQUIRE(decode_error(state.get(), bytes({0xa5, 'a'})).code == lua::MessagePackResult::Code::Truncated);
+        // A huge count is rejected before the table is created.
+        REQUIRE(decode_error(state.get(), bytes({0xdd, 0xff, 0xff, 0xff, 0xff, 0x01})).code == lua::MessagePackResult::Code::Truncated);
+        REQUIRE(decode_error(state.get(), bytes({0x01, 0x02})).code == lua::MessagePackResult::Code::InvalidData);
+        REQUIRE(decode_error(state.get(), bytes({0xc1})).code == lua::MessagePackResult::Code::InvalidData);
+        REQUIRE(decode_error(state.get(), bytes({0x81, 0xc0, 0x01})).code == lua::MessagePackResult::Code::InvalidData);
+        REQUIRE(decode_error(state.get(), bytes({0xd4, 0x01, 0x00})).code == lua::MessagePackResult::Code::UnsupportedType);
+
+        auto nested = decode_error(state.get(), bytes({0x91, 0x91, 0x91, 0x90}), 2);
+        REQUIRE(nested.code == lua::MessagePackResult::Code::TooDeep);
+        REQUIRE(nested.offset == 3);
+    }
+}
@@ -0,0 +1,119 @@
+#include <doctest/doctest.h>
+#include <atomic>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <lua-cts-pool.hpp>
+
+namespace {
+// Worker threads don't use doctest's assertions, errors are thrown and counted by the pool instead.
+void load_square(lua_State* state)
+{
+    if (luaL_loadstring(state, "function square(x) return x * x end") != LUA_OK) {
+        throw std::runtime_error("Can't load the chunk");
+    }
+    lua_call(state, 0, 0);
+}
+
+std::uint64_t total(const std::vector<lua::WorkerStats>& stats, std::uint64_t lua::WorkerStats::*counter)
+{
+    return std::accumulate(stats.begin(), stats.end(), std::uint64_t{0}, [counter] (std::uint64_t sum, const lua::WorkerStats& worker) {
+        return sum + worker.*counter;
+    });
+}
+}
+
+TEST_CASE("state pool")
+{
+    auto pool = lua::StatePool(4, load_square);
+    REQUIRE(pool.size() == 4);
+
+    DOCTEST_SUBCASE("Tasks run on the prepared states")
+    {
+        auto sum = std::atomic<lua_Integer>{0};
+        for (auto i = lua_Integer{1}; i <= 1000; i++) {
+            pool.submit([&sum, i] (lua_State* state) {
+                lua_getglobal(state, "square");
+                auto s = lua::StackWrapper<lua::Function>(state).pushinteger(i).call<1, 1>()
+                    .tointeger<1>([&sum] (lua_Integer x) { sum += x; });
+                static_assert(std::is_same_v<decltype(s), lua::StackWrapper<lua::Number>>);
+            });
+        }
+        pool.wait_idle();
+        REQUIRE(sum == 1000 * 1001 * 2001 / 6);
+
+        auto stats = pool.stats();
+        REQUIRE(total(stats, &lua::WorkerStats::executed) == 1000);
+        REQUIRE(total(stats, &lua::WorkerStats::failed) == 0);
+        REQUIRE(total(stats, &lua::WorkerStats::stolen) <= 1000);
+        auto latencies = std::uint64_t{0};
+        for (const auto& worker : stats) {
+            REQUIRE(worker.queue_depth == 0);
+            latencies = std::accumulate(worker.latency.begin(), worker.latency.end(), latencies);
+        }
+        REQUIRE(latencies == 1000);
+    }
+
+    DOCTEST_SUBCASE("Every task starts with an empty stack")
+    {
+        auto dirty = std::atomic<int>{0};
+        for (auto i = 0; i < 100; i++) {
+            pool.submit([&dirty] (lua_State* state) {
+                if (lua_gettop(state) != 0) {
+                    dirty++;
+                }
+                lua_pushinteger(state, 1);
+            });
+        }
+        pool.wait_idle();
+        REQUIRE(dirty == 0);
+    }
+
+    DOCTEST_SUBCASE("Submitting from several threads")
+    {
+        auto ran = std::atomic<int>{0};
+        auto submitted = std::atomic<int>{0};
+        auto submitters = std::vector<std::thread>();
+        for (auto i = 0; i < 4; i++) {
+            submitters.emplace_back([&pool, &ran, &submitted] {
+                for (auto j = 0; j < 500; j++) {
+                    pool.submit([&ran] (lua_State*) { ran++; });
+                    submitted++;
+                }
+            });
+        }
+        // wait_idle() may return before the other threads are done submitting, but only once every task submitted
+        // before the call has finished.
+        while (ran < 2000) {
+            auto before = submitted.load();
+            pool.wait_idle();
+            REQUIRE(ran >= before);
+        }
+        for (auto& submitter : submitters) {
+            submitter.join();
+        }
+        pool.wait_idle();
+        REQUIRE(ran == 2000);
+        REQUIRE(total(pool.stats(), &lua::WorkerStats::executed) == 2000);
+    }
+
+    DOCTEST_SUBCASE("Failing tasks")
+    {
+        pool.submit([] (lua_State*) { throw std::runtime_error("failed"); });
+        pool.wait_idle();
+        REQUIRE(total(pool.stats(), &lua::WorkerStats::failed) == 1);
+
+        auto ran = std::atomic<bool>{false};
+        pool.submit([&ran] (lua_State*) { ran = true; });
+        pool.wait_idle();
+        REQUIRE(ran);
+    }
+
+    DOCTEST_SUBCASE("Setup errors")
+    {
+        REQUIRE_THROWS(lua::StatePool(2, [] (lua_State*) { throw std::runtime_error("failed"); }));
+        REQUIRE_THROWS(lua::StatePool(0, load_square));
+    }
+}
@@ -0,0 +1,127 @@
+#include <doctest/doctest.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <lua-cts-scheduler.hpp>
+
+using namespace std::chrono_literals;
+
+namespace {
+// Starts `code` as a new task.
+lua::Scheduler::TaskId spawn(lua::Scheduler& scheduler, lua_State* state, const char* code)
+{
+    REQUIRE(luaL_loadstring(state, code) == LUA_OK);
+    auto id = lua::Scheduler::TaskId{};
+    auto s = scheduler.spawn(lua::StackWrapper<lua::Function>(state), id);
+    static_assert(std::is_same_v<decltype(s), lua::StackWrapper<>>);
+    return id;
+}
+
+std::vector<std::string> read_log(lua_State* state)
+{
+    auto log = std::vector<std::string>();
+    lua_getglobal(state, "log");
+    auto s = lua::StackWrapper<lua::Table>(state).toarray<1>(log, [] (lua::ReadResult result) { REQUIRE(result); });
+    (void)s.pop<1>();
+    return log;
+}
+}
+
+TEST_CASE("scheduler")
+{
+    auto state = std::unique_ptr<lua_State, decltype(&lua_close)>(luaL_newstate(), lua_close);
+    auto errors = std::vector<std::string>();
+    auto scheduler = lua::Scheduler([&errors] (lua::Scheduler::TaskId, std::string_view message) {
+        errors.emplace_back(message);
+    });
+    (void)scheduler.pushlibrary(lua::StackWrapper<>(state.get()));
+    lua_setglobal(state.get(), "scheduler");
+    lua_newtable(state.get());
+    lua_setglobal(state.get(), "log");
+
+    auto start = lua::Scheduler::TimePoint{};
+
+    DOCTEST_SUBCASE("Tasks take turns")
+    {
+        spawn(scheduler, state.get(), "log[#log + 1] = 'a1'; scheduler.yield(); log[#log + 1] = 'a2'");
+        spawn(scheduler, state.get(), "log[#log + 1] = 'b1'; scheduler.yield(); log[#log + 1] = 'b2'");
+        REQUIRE(scheduler.task_count() == 2);
+
+        REQUIRE(scheduler.run(start) == 2);
+        REQUIRE(read_log(state.get()) == std::vector<std::string>{"a1", "b1"});
+        REQUIRE(scheduler.has_ready_tasks());
+
+        REQUIRE(scheduler.run(start) == 2);
+        REQUIRE(read_log(state.get()) == std::vector<std::string>{"a1", "b1", "a2", "b2"});
+        REQUIRE(scheduler.task_count() == 0);
+    }
+
+    DOCTEST_SUBCASE("Timers")
+    {
+        auto id = spawn(scheduler, state.get(), "scheduler.sleep(1.5); log[1] = 'woke up'");
+        REQUIRE(scheduler.run(start) == 1);
+        REQUIRE(scheduler.state(id) == lua::Scheduler::TaskState::Sleeping);
+        REQUIRE(scheduler.next_deadline() == start + 1500ms);
+
+        REQUIRE(scheduler.run(start + 1s) == 0);
+        REQUIRE(read_log(state.get()).empty());
+
+        REQUIRE(scheduler.run(start + 2s) == 1);
+        REQUIRE(read_log(state.get()) == std::vector<std::string>{"woke up"});
+        REQUIRE(scheduler.state(id) == lua::Scheduler::TaskState::Finished);
+        REQUIRE(!scheduler.next_deadline());
+    }
+
+    DOCTEST_SUBCASE("Events")
+    {
+        auto id = spawn(scheduler, state.get(), "local data, size = scheduler.wait(7); log[1] = data .. size");
+        REQUIRE(scheduler.run(start) == 1);
+        REQUIRE(scheduler.state(id) == lua::Scheduler::TaskState::Waiting);
+        REQUIRE(scheduler.notify(8) == 0);
+        REQUIRE(scheduler.run(start) == 0);
+
+        REQUIRE(scheduler.notify(7, std::string_view("data"), lua_Integer{4}) == 1);
+        REQUIRE(scheduler.state(id) == lua::Scheduler::TaskState::Ready);
+        REQUIRE(scheduler.run(start) == 1);
+        REQUIRE(read_log(state.get()) == std::vector<std::string>{"data4"});
+    }
+
+    DOCTEST_SUBCASE("Errors")
+    {
+        auto id = spawn(scheduler, state.get(), "scheduler.wait('seven')");
+        REQUIRE(scheduler.run(start) == 1);
+        REQUIRE(scheduler.state(id) == lua::Scheduler::TaskState::Finished);
+        // luaL_error prefixes the message with the position of the Lua code which called wait().
+        REQUIRE(errors == std::vector<std::string>{"[string \"scheduler.wait('seven')\"]:1: stack value #1 should have been an integer (got string)"});
+
+        errors.clear();
+        spawn(scheduler, state.get(), "scheduler.sleep(-1)");
+        spawn(scheduler, state.get(), "scheduler.sleep(0 / 0)");
+        spawn(scheduler, state.get(), "scheduler.sleep(1 / 0)");
+        lua_pushcfunction(state.get(), [] (lua_State* state) {
+            lua_newtable(state);
+            return lua_error(state);
+        });
+        auto table_error = lua::Scheduler::TaskId{};
+        (void)scheduler.spawn(lua::StackWrapper<lua::Function>(state.get()), table_error);
+        REQUIRE(scheduler.run(start) == 4);
+        REQUIRE(errors.size() == 4);
+        for (auto i = 0; i < 3; i++) {
+            REQUIRE(errors[i].find("bad argument #1 to 'sleep' (expected a finite, non-negative number of seconds)") != std::string::npos);
+        }
+        REQUIRE(errors[3] == "error object is not a string");
+        REQUIRE(scheduler.task_count() == 0);
+
+        // Huge sleeps are cut to a century instead of overflowing the clock.
+        spawn(scheduler, state.get(), "scheduler.sleep(1e300)");
+        REQUIRE(scheduler.run(start) == 1);
+        REQUIRE(scheduler.next_deadline() > start + std::chrono::hours(24 * 365 * 99));
+        REQUIRE(scheduler.next_deadline() < start + std::chrono::hours(24 * 365 * 101));
+
+        REQUIRE(luaL_loadstring(state.get(), "scheduler.yield()") == LUA_OK);
+        REQUIRE(lua_pcall(state.get(), 0, 0, 0) != LUA_OK);
+        lua_pop(state.get(), 1);
+    }
+}
@@ -1,5 +1,7 @@
 #include <doctest/doctest.h>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <lua-cts.hpp>
 
@@ -37,6 +39,74 @@ int some_function(lua_State* state)
     return NResults;
 }
 
+struct Response {
+    lua_Integer id;
+    double score;
+    bool ok;
+    std::string name;
+    std::vector<int> values;
+};
+
+class Counter {
+public:
+    Counter(int value, int& destroyed)
+        : m_value(value)
+        , m_destroyed(destroyed)
+    {
+    }
+
+    Counter(const Counter&) = delete;
+    Counter& operator=(const Counter&) = delete;
+
+    ~Counter()
+    {
+        m_destroyed++;
+    }
+
+    int value() const
+    {
+        return m_value;
+    }
+
+private:
+    int m_value;
+    int& m_destroyed;
+};
+
+constexpr auto response_schema = lua::schema(
+    lua::field("id", &Response::id),
+    lua::field("score", &Response::score),
+    lua::field("ok", &Response::ok),
+    lua::field("name", &Response::name),
+    lua::elements(&Response::values));
+
+static_assert(decltype(response_schema)::record_count == 4);
+
+lua_Integer add(lua_Integer a, lua_Integer b)
+{
+    return a + b;
+}
+
+std::tuple<lua_Integer, std::string> describe(std::string_view name, lua_Integer value)
+{
+    return {value * 2, std::string(name) + "!"};
+}
+
+void fail(bool)
+{
+    throw std::runtime_error("failed");
+}
+
+// Yields twice its argument. Resuming it again finishes the coroutine, returning the values it's resumed with.
+int yield_double(lua_State* state)
+{
+    auto x = lua_Integer{};
+    auto s = lua::StackWrapper<lua::Integer>(state).tointeger<1>([&x] (lua_Integer value) { x = value; });
+    return s.pushinteger(x * 2).yield<1>();
+}
+
+inline constexpr lua::Key cached_key("cached");
+
 static_assert(std::is_same_v<lua::StackWrapper<lua::Number>, lua::pop_front_t<lua::StackWrapper<lua::Number>, 0>>);
 static_assert(std::is_same_v<lua::StackWrapper<>, lua::pop_front_t<lua::StackWrapper<lua::Number>, 1>>);
 static_assert(std::is_same_v<lua::StackWrapper<lua::Nil>, lua::pop_front_t<lua::StackWrapper<lua::Number, lua::Nil>, 1>>);
@@ -79,6 +149,15 @@ static_assert(std::is_same_v<lua::StackWrapper<lua::Number, lua::Function, lua::
 static_assert(std::is_same_v<lua::StackWrapper<lua::Nil, lua::Number, lua::Function>, lua::rotate_t<lua::StackWrapper<lua::Nil, lua::Number, lua::Function>, 1, 3>>);
 static_assert(std::is_same_v<lua::StackWrapper<lua::Function, lua::Nil, lua::Number>, lua::rotate_t<lua::StackWrapper<lua::Nil, lua::Number, lua::Function>, 1, 4>>);
 
+static_assert(std::is_same_v<lua::StackWrapper<lua::Number, lua::Function, lua::Nil>, lua::rotate_t<lua::StackWrapper<lua::Nil, lua::Number, lua::Function>, 1, -1>>);
+static_assert(std::is_same_v<lua::StackWrapper<lua::Nil, lua::Function, lua::Number>, lua::rotate_t<lua::StackWrapper<lua::Nil, lua::Number, lua::Function>, -2, -1>>);
+static_assert(std::is_same_v<lua::StackWrapper<lua::Function, lua::Nil, lua::Number>, lua::rotate_t<lua::StackWrapper<lua::Nil, lua::Number, lua::Function>, 1, 301>>);
+
+static_assert(std::is_same_v<lua::Nil, lua::nth_type_t<0, lua::Nil, lua::Number, lua::Function>>);
+static_assert(std::is_same_v<lua::Function, lua::nth_type_t<2, lua::Nil, lua::Number, lua::Function>>);
+static_assert(std::is_same_v<lua::Function, lua::select_type_t<lua::append_times_t<lua::StackWrapper<lua::Function>, lua::Nil, 300>, 1>>);
+static_assert(lua::append_times_t<lua::StackWrapper<>, lua::Nil, 300>::stack_size == 300);
+
 static_assert(std::is_same_v<lua::StackWrapper<lua::Unknown>, lua::append_times_t<lua::StackWrapper<>, lua::Unknown, 1>>);
 static_assert(std::is_same_v<lua::StackWrapper<lua::Unknown, lua::Unknown>, lua::append_times_t<lua::StackWrapper<>, lua::Unknown, 2>>);
 static_assert(std::is_same_v<lua::StackWrapper<lua::Number, lua::Unknown, lua::Unknown>, lua::append_times_t<lua::StackWrapper<lua::Number>, lua::Unknown, 2>>);
@@ -98,19 +177,250 @@ TEST_CASE("stack")
     DOCTEST_SUBCASE("Runtime stack checking")
     {
         auto s = lua::StackWrapper<>(mock_state.get()).pushinteger(1);
-        REQUIRE_STACK(s, lua::Number);
+        REQUIRE_STACK(s, lua::Integer);
         REQUIRE_THROWS(lua::StackWrapper<>(mock_state.get()));
         REQUIRE_THROWS(lua::StackWrapper<lua::Nil>(mock_state.get()));
         auto s2 = lua::StackWrapper<lua::Number>(mock_state.get());
         REQUIRE_STACK(s2, lua::Number);
     }
 
+    DOCTEST_SUBCASE("Validation policy")
+    {
+        DOCTEST_SUBCASE("Transitions are trusted by default")
+        {
+            auto s = lua::StackWrapper<>(mock_state.get()).pushinteger(1);
+            REQUIRE_STACK(s, lua::Integer);
+            lua_pushnil(mock_state.get());
+            REQUIRE_NOTHROW((void)s.pushinteger(2));
+        }
+
+        DOCTEST_SUBCASE("Paranoid policy revalidates every transition")
+        {
+            using ParanoidStack = lua::with_policy<lua::ParanoidPolicy>;
+            auto s = ParanoidStack::StackWrapper<>(mock_state.get()).pushinteger(1);
+            static_assert(std::is_same_v<decltype(s), ParanoidStack::StackWrapper<lua::Integer>>);
+            lua_pushnil(mock_state.get());
+            REQUIRE_THROWS((void)s.pushinteger(2));
+        }
+    }
+
+    DOCTEST_SUBCASE("Reserving stack space")
+    {
+        using ReservedStack = lua::with_policy<lua::ReservedPolicy<lua::DefaultPolicy, 3>>;
+        auto s = lua::StackWrapper<>(mock_state.get()).pushnil().reserve<2>();
+        static_assert(std::is_same_v<decltype(s), ReservedStack::StackWrapper<lua::Nil>>);
+        auto s2 = s.pushinteger(1).pop<1>().reserve<1>();
+        static_assert(std::is_same_v<decltype(s2), ReservedStack::StackWrapper<lua::Nil>>);
+        auto s3 = s2.pushinteger(1).pushinteger(2).reserve<3>();
+        static_assert(std::is_same_v<decltype(s3), lua::with_policy<lua::ReservedPolicy<lua::ReservedPolicy<lua::DefaultPolicy, 3>, 6>>::StackWrapper<lua::Nil, lua::Integer, lua::Integer>>);
+        auto s4 = lua::StackWindow<lua::Number>(mock_state.get()).reserve<1>();
+        static_assert(std::is_same_v<decltype(s4), lua::with_policy<lua::ReservedPolicy<lua::DefaultPolicy, 2>>::StackWindow<lua::Number>>);
+        REQUIRE_THROWS((void)lua::StackWindow<>(mock_state.get()).reserve<1'000'000'000>());
+    }
+
+    DOCTEST_SUBCASE("Instrumentation")
+    {
+        using InstrumentedStack = lua::with_policy<lua::InstrumentedPolicy<>>;
+        auto before = lua::instrumentation_snapshot();
+        auto s = InstrumentedStack::StackWrapper<>(mock_state.get()).newtable().pushinteger(1).setfield<1>("x")
+            .getfield<1>("x").tointeger<2>([] (lua_Integer x) { REQUIRE(x == 1); }).pop<1>()
+            .pushcfunction(some_function<0, 1>).call<0, 1>().pop<1>();
+        static_assert(std::is_same_v<decltype(s), InstrumentedStack::StackWrapper<lua::Table>>);
+        REQUIRE_THROWS(InstrumentedStack::StackWrapper<lua::Nil>(mock_state.get()));
+        (void)lua::StackWrapper<lua::Table>(mock_state.get()).pushinteger(1);
+        auto after = lua::instrumentation_snapshot();
+
+        auto delta = [&before, &after] (lua::Operation operation) { return after.count(operation) - before.count(operation); };
+        REQUIRE(delta(lua::Operation::Push) == 3);
+        REQUIRE(delta(lua::Operation::Pop) == 2);
+        REQUIRE(delta(lua::Operation::SetField) == 1);
+        REQUIRE(delta(lua::Operation::GetField) == 1);
+        REQUIRE(delta(lua::Operation::Call) == 1);
+        REQUIRE(delta(lua::Operation::PCall) == 0);
+        REQUIRE(delta(lua::Operation::TypeCheck) == 3);
+        REQUIRE(delta(lua::Operation::Failure) == 1);
+        REQUIRE(after.stack_high_water >= 2);
+        REQUIRE(after.call_time >= before.call_time);
+    }
+
+    DOCTEST_SUBCASE("Lazy chains")
+    {
+        auto s = lua::StackWrapper<>(mock_state.get()).newtable().pushinteger(1).pushinteger(2).pushinteger(3);
+        REQUIRE_STACK(s, lua::Table, lua::Integer, lua::Integer, lua::Integer);
+
+        // Rotating a window of three values three times does nothing.
+        auto rotated = s.lazy().rotate<2, 1>().rotate<2, 1>().rotate<2, 1>();
+        static_assert(decltype(rotated)::operation_count == 0);
+        auto merged = rotated.rotate<2, 1>().rotate<-3, 3>().insert<-3>();
+        static_assert(std::is_same_v<decltype(merged), lua::LazyChain<lua::StackWrapper<lua::Table, lua::Integer, lua::Integer, lua::Integer>,
+            lua::StackWrapper<lua::Table, lua::Integer, lua::Integer, lua::Integer>, std::tuple<lua::RotateOp<-3, 2>>>>);
+        auto s2 = merged.run().tointeger<2>([] (lua_Integer x) { REQUIRE(x == 2); });
+        REQUIRE_STACK(s2, lua::Table, lua::Integer, lua::Integer, lua::Integer);
+
+        auto popped = s2.lazy().pushnil().pop<1>().pushboolean(true).pop<2>().pop<1>();
+        static_assert(decltype(popped)::operation_count == 1);
+        auto s3 = popped.run();
+        REQUIRE_STACK(s3, lua::Table, lua::Integer);
+        REQUIRE(lua_gettop(mock_state.get()) == 2);
+
+        auto stored = s3.lazy().pushinteger(5).setfield<1>("five").pushliteral("one").rawseti<1>(1).pushnil().pop<1>();
+        // Each push is fused with the store which takes it, the last push is removed by the pop.
+        static_assert(decltype(stored)::operation_count == 2);
+        auto s4 = stored.run().getfield<1>("five").tointeger<-1>([] (lua_Integer x) { REQUIRE(x == 5); }).pop<1>()
+            .rawgeti<1>(1).tostring<-1>([] (const char* x) { REQUIRE(std::string_view(x) == "one"); }).pop<1>();
+        REQUIRE_STACK(s4, lua::Table, lua::Integer);
+
+        using InstrumentedStack = lua::with_policy<lua::InstrumentedPolicy<>>;
+        auto before = lua::instrumentation_snapshot();
+        auto s5 = InstrumentedStack::StackWrapper<lua::Table, lua::Integer>(mock_state.get()).lazy()
+            .pushinteger(6).pushnil().pop<1>().setfield<1>("six").run();
+        static_assert(std::is_same_v<decltype(s5), InstrumentedStack::StackWrapper<lua::Table, lua::Integer>>);
+        auto after = lua::instrumentation_snapshot();
+        REQUIRE(after.count(lua::Operation::Push) - before.count(lua::Operation::Push) == 1);
+        REQUIRE(after.count(lua::Operation::SetField) - before.count(lua::Operation::SetField) == 1);
+        REQUIRE(after.stack_high_water >= 3);
+    }
+
+    DOCTEST_SUBCASE("Lazy pops of zero values")
+    {
+        auto s = lua::StackWrapper<>(mock_state.get()).pushinteger(1).pushinteger(2);
+        auto eager = s.pushnil().pop<0>();
+        auto eager_size = lua_gettop(mock_state.get());
+        auto s2 = eager.pop<1>();
+
+        auto lazy = s2.lazy().pushnil().pop<0>();
+        static_assert(decltype(lazy)::operation_count == 1);
+        auto s3 = lazy.run();
+        REQUIRE_STACK(s3, lua::Integer, lua::Integer, lua::Nil);
+        REQUIRE(lua_gettop(mock_state.get()) == eager_size);
+        REQUIRE(lua_gettop(mock_state.get()) == 3);
+        REQUIRE_STACK(s3.lazy().pop<0>().run(), lua::Integer, lua::Integer, lua::Nil);
+        REQUIRE(lua_gettop(mock_state.get()) == 3);
+    }
+
+    DOCTEST_SUBCASE("Visiting values")
+    {
+        auto describe = [] (lua::StackWrapper<lua::Table, lua::Unknown> s) {
+            return s.visit<-1>([] (lua::StackWrapper<lua::Table, lua::Number> s) {
+                std::string result;
+                auto s2 = s.tonumber<2>([&result] (lua_Number x) { result = "number " + std::to_string(static_cast<int>(x)); });
+                static_assert(std::is_same_v<decltype(s2), lua::StackWrapper<lua::Table, lua::Number>>);
+                (void)s2.pop<1>();
+                return result;
+            }, [] (lua::StackWrapper<lua::Table, lua::String> s) {
+                std::string result;
+                (void)s.tostring<2>([&result] (const char* x) { result = std::string("string ") + x; }).pop<1>();
+                return result;
+            }, [] (lua::StackWrapper<lua::Table, lua::Table> s) {
+                (void)s.setfield<1>("self").pop<0>();
+                return std::string("table");
+            }, [] (auto s) {
+                (void)s.template pop<1>();
+                return std::string("other");
+            });
+        };
+
+        auto s = lua::StackWrapper<>(mock_state.get()).newtable();
+        REQUIRE(describe(s.getfield<1>("missing")) == "other");
+        REQUIRE(describe(s.pushinteger(4).setfield<1>("x").getfield<1>("x")) == "number 4");
+        REQUIRE(describe(s.pushstring("abc").setfield<1>("x").getfield<1>("x")) == "string abc");
+        REQUIRE(describe(s.newtable().setfield<1>("x").getfield<1>("x")) == "table");
+        REQUIRE(lua_gettop(mock_state.get()) == 1);
+        REQUIRE(lua_type(mock_state.get(), -1) == LUA_TTABLE);
+
+        // Known values go straight to their handler.
+        auto known = s.pushboolean(true).visit<2>([] (lua::StackWrapper<lua::Table, lua::Boolean> s) {
+            return s.pop<1>();
+        }, [] (auto s) {
+            FAIL("The boolean handler should have been called");
+            return s.template pop<1>();
+        });
+        REQUIRE_STACK(known, lua::Table);
+    }
+
+    DOCTEST_SUBCASE("Stack windows")
+    {
+        lua_pushnil(mock_state.get());
+        lua_pushnil(mock_state.get());
+
+        DOCTEST_SUBCASE("Only the window is checked")
+        {
+            auto s = lua::StackWindow<lua::Nil>(mock_state.get());
+            static_assert(std::is_same_v<decltype(s), lua::StackWindow<lua::Nil>>);
+            REQUIRE_THROWS(lua::StackWindow<lua::Number>(mock_state.get()));
+            REQUIRE_THROWS(lua::StackWindow<lua::Nil, lua::Nil, lua::Nil>(mock_state.get()));
+            REQUIRE_THROWS(lua::StackWindow<lua::Nil>(mock_state.get(), lua::StackBase{0}));
+            REQUIRE_NOTHROW(lua::StackWindow<lua::Nil>(mock_state.get(), lua::StackBase{1}));
+        }
+
+        DOCTEST_SUBCASE("Operations use indices inside the window")
+        {
+            auto s = lua::StackWindow<>(mock_state.get()).newtable().pushinteger(1);
+            static_assert(std::is_same_v<decltype(s), lua::StackWindow<lua::Table, lua::Integer>>);
+            auto s2 = s.setfield<1>("field").getfield<1>("field").tointeger<2>([] (int x) { REQUIRE(x == 1); });
+            static_assert(std::is_same_v<decltype(s2), lua::StackWindow<lua::Table, lua::Number>>);
+            auto s3 = s2.insert<1>().gettop([] (int x) { REQUIRE(x == 2); });
+            static_assert(std::is_same_v<decltype(s3), lua::StackWindow<lua::Number, lua::Table>>);
+            auto s4 = s3.pop<2>();
+            static_assert(std::is_same_v<decltype(s4), lua::StackWindow<>>);
+            REQUIRE(lua_gettop(mock_state.get()) == 2);
+            REQUIRE(lua_type(mock_state.get(), 1) == LUA_TNIL);
+            REQUIRE(lua_type(mock_state.get(), 2) == LUA_TNIL);
+        }
+
+        DOCTEST_SUBCASE("Calls")
+        {
+            auto s = lua::StackWindow<>(mock_state.get()).pushcfunction(some_function<0, 2>).call<0, LUA_MULTRET>();
+            REQUIRE(s.result_count() == 2);
+            REQUIRE(s.type(1) == LUA_TNUMBER);
+            auto s2 = s.resolve<lua::Number, lua::Number>();
+            static_assert(std::is_same_v<decltype(s2), lua::StackWindow<lua::Number, lua::Number>>);
+        }
+    }
+
+    DOCTEST_SUBCASE("Error policies")
+    {
+        lua_pushinteger(mock_state.get(), 1);
+
+        DOCTEST_SUBCASE("Checking without exceptions")
+        {
+            auto ok = lua::StackWrapper<lua::Integer>::try_create(mock_state.get(), [] (auto s) {
+                REQUIRE_STACK(s, lua::Integer);
+                return true;
+            }, [] (lua::StackError) { return false; });
+            REQUIRE(ok);
+
+            auto error = lua::StackWrapper<lua::String>::try_create(mock_state.get(), [] (auto) {
+                return lua::StackError{};
+            }, [] (lua::StackError error) { return error; });
+            REQUIRE(error.code == lua::StackError::Code::WrongType);
+            REQUIRE(error.index == 1);
+            REQUIRE(error.got == LUA_TNUMBER);
+            REQUIRE(std::string_view(error.expected) == lua::String::name);
+
+            auto size_error = lua::StackWindow<lua::Integer, lua::Integer>::try_create(mock_state.get(), [] (auto) {
+                return lua::StackError{};
+            }, [] (lua::StackError error) { return error; });
+            REQUIRE(size_error.code == lua::StackError::Code::NotEnoughValues);
+        }
+
+        DOCTEST_SUBCASE("Lua errors")
+        {
+            auto s = lua::StackWrapper<lua::Integer>(mock_state.get()).pop<1>().pushcfunction([] (lua_State* state) {
+                (void)lua::with_policy<lua::LuaErrorPolicy>::StackWrapper<lua::String>(state);
+                return 0;
+            }).pushinteger(1).pcall<1, 0, 0>().resolve<lua::String>()
+                .tolstring<1>([] (std::string_view x) { REQUIRE(x == "stack value #1 should have been a string (got number)"); });
+            REQUIRE_STACK(s, lua::String);
+        }
+    }
+
     DOCTEST_SUBCASE("Unknown types")
     {
         DOCTEST_SUBCASE("Initializing")
         {
             auto s = lua::StackWrapper<>(mock_state.get()).pushinteger(1);
-            REQUIRE_STACK(s, lua::Number);
+            REQUIRE_STACK(s, lua::Integer);
             auto s2 = lua::StackWrapper<lua::Unknown>(mock_state.get());
             REQUIRE_STACK(s2, lua::Unknown);
             REQUIRE_THROWS(lua::StackWrapper<lua::Unknown, lua::Unknown>(mock_state.get()));
@@ -119,11 +429,11 @@ TEST_CASE("stack")
         DOCTEST_SUBCASE("Asserting types")
         {
             auto s = lua::StackWrapper<>(mock_state.get()).pushinteger(1);
-            REQUIRE_STACK(s, lua::Number);
+            REQUIRE_STACK(s, lua::Integer);
             auto s2 = lua::StackWrapper<lua::Unknown>(mock_state.get());
             REQUIRE_STACK(s2, lua::Unknown);
             auto s3 = s.tointeger<-1>([] (int x) { REQUIRE(x == 1); } );
-            REQUIRE_STACK(s3, lua::Number);
+            REQUIRE_STACK(s3, lua::Integer);
         }
     }
 
@@ -133,11 +443,11 @@ TEST_CASE("stack")
         DOCTEST_SUBCASE("Integer")
         {
             auto s2 = s.pushinteger(1);
-            REQUIRE_STACK(s2, lua::Number);
+            REQUIRE_STACK(s2, lua::Integer);
             auto s3 = s2.tointeger<1>([] (int x) {REQUIRE(x == 1);} );
-            REQUIRE_STACK(s3, lua::Number);
+            REQUIRE_STACK(s3, lua::Integer);
             auto s4 = s3.tointeger<-1>([] (int x) {REQUIRE(x == 1);} );
-            REQUIRE_STACK(s4, lua::Number);
+            REQUIRE_STACK(s4, lua::Integer);
         }
 
         DOCTEST_SUBCASE("C Function")
@@ -168,6 +478,128 @@ TEST_CASE("stack")
         }
     }
 
+    DOCTEST_SUBCASE("Numbers, booleans and userdata")
+    {
+        auto s = lua::StackWrapper<>(mock_state.get());
+
+        DOCTEST_SUBCASE("64-bit integers")
+        {
+            constexpr auto big = lua_Integer{1} << 40;
+            auto s2 = s.pushinteger(big).tointeger<1>([] (lua_Integer x) { REQUIRE(x == big); });
+            REQUIRE_STACK(s2, lua::Integer);
+            REQUIRE_THROWS(lua::StackWrapper<lua::Float>(mock_state.get()));
+        }
+
+        DOCTEST_SUBCASE("Floats")
+        {
+            auto s2 = s.pushnumber(1.5).tonumber<1>([] (lua_Number x) { REQUIRE(x == 1.5); });
+            REQUIRE_STACK(s2, lua::Float);
+            REQUIRE_THROWS((void)s2.tointeger<1>([] (lua_Integer) {}));
+            REQUIRE_THROWS(lua::StackWrapper<lua::Integer>(mock_state.get()));
+            auto s3 = lua::StackWrapper<lua::Number>(mock_state.get());
+            REQUIRE_STACK(s3, lua::Number);
+        }
+
+        DOCTEST_SUBCASE("Floats with an integer representation")
+        {
+            auto s2 = s.pushnumber(2.0).tointeger<1>([] (lua_Integer x) { REQUIRE(x == 2); });
+            REQUIRE_STACK(s2, lua::Float);
+        }
+
+        DOCTEST_SUBCASE("Booleans")
+        {
+            auto s2 = s.pushboolean(true).toboolean<1>([] (bool x) { REQUIRE(x); });
+            REQUIRE_STACK(s2, lua::Boolean);
+            auto s3 = lua::StackWrapper<lua::Unknown>(mock_state.get()).toboolean<1>([] (bool x) { REQUIRE(x); });
+            REQUIRE_STACK(s3, lua::Boolean);
+            (void)s3.pushinteger(1);
+            REQUIRE_THROWS((void)lua::StackWrapper<lua::Boolean, lua::Unknown>(mock_state.get()).toboolean<2>([] (bool) {}));
+        }
+
+        DOCTEST_SUBCASE("Light userdata")
+        {
+            auto value = 0;
+            auto s2 = s.pushlightuserdata(&value).tolightuserdata<1>([&value] (void* x) { REQUIRE(x == &value); });
+            REQUIRE_STACK(s2, lua::LightUserdata);
+        }
+    }
+
+    DOCTEST_SUBCASE("Full userdata")
+    {
+        auto destroyed = 0;
+        auto s = lua::StackWrapper<>(mock_state.get()).pushuserdata<Counter>(5, destroyed);
+        REQUIRE_STACK(s, lua::UserdataOf<Counter>);
+
+        DOCTEST_SUBCASE("Reading")
+        {
+            auto s2 = s.touserdata<Counter, 1>([] (Counter& counter) { REQUIRE(counter.value() == 5); });
+            REQUIRE_STACK(s2, lua::UserdataOf<Counter>);
+            auto s3 = lua::StackWrapper<lua::Unknown>(mock_state.get()).touserdata<Counter, 1>([] (Counter& counter) { REQUIRE(counter.value() == 5); });
+            REQUIRE_STACK(s3, lua::UserdataOf<Counter>);
+            REQUIRE_THROWS((void)lua::StackWrapper<lua::Userdata>(mock_state.get()).touserdata<Response, 1>([] (Response&) {}));
+        }
+
+        DOCTEST_SUBCASE("Shared metatable")
+        {
+            auto s2 = s.pushuserdata<Counter>(6, destroyed).pushmetatable<Counter>();
+            REQUIRE_STACK(s2, lua::UserdataOf<Counter>, lua::UserdataOf<Counter>, lua::Table);
+            REQUIRE(lua_getmetatable(mock_state.get(), 1));
+            REQUIRE(lua_getmetatable(mock_state.get(), 2));
+            REQUIRE(lua_rawequal(mock_state.get(), -1, -2));
+            REQUIRE(lua_rawequal(mock_state.get(), -1, 3));
+            lua_pop(mock_state.get(), 2);
+        }
+
+        DOCTEST_SUBCASE("Destructor")
+        {
+            auto s2 = s.pop<1>();
+            REQUIRE_STACK(s2,);
+            lua_gc(mock_state.get(), LUA_GCCOLLECT);
+            REQUIRE(destroyed == 1);
+        }
+
+        // The userdata refer to `destroyed`, so they must be collected before it goes away.
+        lua_settop(mock_state.get(), 0);
+        lua_gc(mock_state.get(), LUA_GCCOLLECT);
+    }
+
+    DOCTEST_SUBCASE("Length-aware strings")
+    {
+        auto s = lua::StackWrapper<>(mock_state.get());
+
+        DOCTEST_SUBCASE("Embedded zeros")
+        {
+            using namespace std::string_view_literals;
+            auto sv = "some\0string"sv;
+            auto s2 = s.pushlstring(sv);
+            REQUIRE_STACK(s2, lua::String);
+            auto s3 = s2.tolstring<-1>([&sv] (std::string_view str) { REQUIRE(str == sv); });
+            REQUIRE_STACK(s3, lua::String);
+        }
+
+        DOCTEST_SUBCASE("Not NUL-terminated")
+        {
+            auto sv = std::string_view("some_string").substr(0, 4);
+            auto s2 = s.pushlstring(sv).tolstring<1>([] (std::string_view str) { REQUIRE(str == "some"); });
+            REQUIRE_STACK(s2, lua::String);
+        }
+
+        DOCTEST_SUBCASE("Literals")
+        {
+            auto s2 = s.pushliteral("literal").tolstring<1>([] (std::string_view str) { REQUIRE(str == "literal"); });
+            REQUIRE_STACK(s2, lua::String);
+        }
+
+        DOCTEST_SUBCASE("Unknown values")
+        {
+            (void)s.pushliteral("value");
+            auto s2 = lua::StackWrapper<lua::Unknown>(mock_state.get()).tolstring<1>([] (std::string_view str) { REQUIRE(str == "value"); });
+            REQUIRE_STACK(s2, lua::String);
+            (void)s2.pop<1>().pushinteger(1);
+            REQUIRE_THROWS((void)lua::StackWrapper<lua::Unknown>(mock_state.get()).tolstring<1>([] (std::string_view) {}));
+        }
+    }
+
     DOCTEST_SUBCASE("Querying type")
     {
         auto s = lua::StackWrapper<>(mock_state.get());
@@ -176,9 +608,9 @@ TEST_CASE("stack")
         DOCTEST_SUBCASE("number")
         {
             auto s2 = s.pushinteger(1);
-            REQUIRE_STACK(s2, lua::Number);
+            REQUIRE_STACK(s2, lua::Integer);
             auto s3 = s2.type<1>([] (int type) {REQUIRE(type == LUA_TNUMBER);});
-            REQUIRE_STACK(s3, lua::Number);
+            REQUIRE_STACK(s3, lua::Integer);
         }
 
         DOCTEST_SUBCASE("nil")
@@ -201,7 +633,7 @@ TEST_CASE("stack")
     DOCTEST_SUBCASE("Popping elements")
     {
         auto s = lua::StackWrapper<>(mock_state.get()).pushinteger(1);
-        REQUIRE_STACK(s, lua::Number);
+        REQUIRE_STACK(s, lua::Integer);
 
         DOCTEST_SUBCASE("Popping one")
         {
@@ -219,7 +651,7 @@ TEST_CASE("stack")
     DOCTEST_SUBCASE("Table manipulation")
     {
         auto s = lua::StackWrapper<>(mock_state.get()).newtable().pushinteger(1);
-        REQUIRE_STACK(s, lua::Table, lua::Number);
+        REQUIRE_STACK(s, lua::Table, lua::Integer);
 
         auto s2 = s.setfield<1>("some_field");
         REQUIRE_STACK(s2, lua::Table);
@@ -249,34 +681,474 @@ TEST_CASE("stack")
         REQUIRE_STACK(s10,);
     }
 
+    DOCTEST_SUBCASE("Raw and integer table access")
+    {
+        auto s = lua::StackWrapper<>(mock_state.get()).newtable();
+
+        DOCTEST_SUBCASE("Integer keys")
+        {
+            auto s2 = s.pushinteger(1).rawseti<1>(1).pushinteger(2).seti<-2>(2);
+            REQUIRE_STACK(s2, lua::Table);
+            auto s3 = s2.rawgeti<1>(1).tointeger<-1>([] (lua_Integer x) { REQUIRE(x == 1); }).pop<1>()
+                .geti<1>(2).tointeger<-1>([] (lua_Integer x) { REQUIRE(x == 2); });
+            REQUIRE_STACK(s3, lua::Table, lua::Number);
+        }
+
+        DOCTEST_SUBCASE("Keys on the stack")
+        {
+            auto s2 = s.pushliteral("key").pushinteger(3).rawset<1>();
+            REQUIRE_STACK(s2, lua::Table);
+            auto s3 = s2.pushliteral("key").pushvalue<-1>();
+            REQUIRE_STACK(s3, lua::Table, lua::String, lua::String);
+            auto s4 = s3.rawget<1>().tointeger<-1>([] (lua_Integer x) { REQUIRE(x == 3); });
+            REQUIRE_STACK(s4, lua::Table, lua::String, lua::Number);
+        }
+
+        DOCTEST_SUBCASE("Cached keys")
+        {
+            auto s2 = s.pushinteger(4).rawsetfield<1>(cached_key);
+            REQUIRE_STACK(s2, lua::Table);
+            REQUIRE(lua_rawgetp(mock_state.get(), LUA_REGISTRYINDEX, &cached_key) == LUA_TSTRING);
+            lua_pop(mock_state.get(), 1);
+            auto s3 = s2.rawgetfield<1>(cached_key).tointeger<-1>([] (lua_Integer x) { REQUIRE(x == 4); }).pop<1>()
+                .getfield<1>("cached").tointeger<-1>([] (lua_Integer x) { REQUIRE(x == 4); })
+                .pushkey(cached_key).tolstring<-1>([] (std::string_view x) { REQUIRE(x == "cached"); });
+            REQUIRE_STACK(s3, lua::Table, lua::Number, lua::String);
+        }
+    }
+
+    DOCTEST_SUBCASE("Registry references")
+    {
+        auto callback = lua::Ref<lua::Function>();
+        REQUIRE(!callback);
+
+        auto s = lua::StackWrapper<>(mock_state.get()).pushcfunction(lua::bind<&add>()).ref(callback);
+        REQUIRE_STACK(s,);
+        REQUIRE(callback);
+
+        DOCTEST_SUBCASE("Pushing keeps the type")
+        {
+            auto s2 = s.pushref(callback).pushinteger(1).pushinteger(2).call<2, 1>()
+                .pop<1>().pushref(callback);
+            REQUIRE_STACK(s2, lua::Function);
+            REQUIRE(lua_tocfunction(mock_state.get(), 1) == lua::bind<&add>());
+        }
+
+        DOCTEST_SUBCASE("Unknown values are checked once")
+        {
+            lua_pushinteger(mock_state.get(), 5);
+            auto number = lua::Ref<lua::Number>();
+            auto s2 = lua::StackWrapper<lua::Unknown>(mock_state.get()).ref(number).pushref(number)
+                .tointeger<1>([] (lua_Integer x) { REQUIRE(x == 5); });
+            REQUIRE_STACK(s2, lua::Number);
+            lua_pushnil(mock_state.get());
+            REQUIRE_THROWS((void)lua::StackWrapper<lua::Number, lua::Unknown>(mock_state.get()).ref(number));
+        }
+
+        DOCTEST_SUBCASE("Releasing")
+        {
+            auto id = callback.get();
+            auto moved = std::move(callback);
+            REQUIRE(!callback);
+            REQUIRE(moved.get() == id);
+            moved.reset();
+            REQUIRE(!moved);
+            REQUIRE(lua_rawgeti(mock_state.get(), LUA_REGISTRYINDEX, id) != LUA_TFUNCTION);
+        }
+    }
+
+    DOCTEST_SUBCASE("Prepared calls")
+    {
+        lua_pushnil(mock_state.get());
+
+        DOCTEST_SUBCASE("One result")
+        {
+            auto call = lua::PreparedCall<lua_Integer(lua_Integer, lua_Integer)>();
+            auto s = lua::StackWindow<>(mock_state.get()).pushcfunction(lua::bind<&add>()).prepare(call);
+            for (auto i = lua_Integer{0}; i < 10; i++) {
+                REQUIRE(call(i, 1) == i + 1);
+            }
+            REQUIRE(lua_gettop(mock_state.get()) == 1);
+            (void)s;
+        }
+
+        DOCTEST_SUBCASE("Multiple results")
+        {
+            auto call = lua::PreparedCall<std::tuple<lua_Integer, std::string>(std::string_view, lua_Integer)>();
+            auto s = lua::StackWindow<>(mock_state.get()).pushcfunction(lua::bind<&describe>()).prepare(call);
+            REQUIRE(call("name", 2) == std::tuple<lua_Integer, std::string>(4, "name!"));
+            REQUIRE(lua_gettop(mock_state.get()) == 1);
+            (void)s;
+        }
+
+        DOCTEST_SUBCASE("Strings are returned by value")
+        {
+            // The results are popped before they're returned, a view would point into a string Lua may have collected.
+            static_assert(std::is_invocable_v<const lua::PreparedCall<std::string()>&>);
+            static_assert(!std::is_invocable_v<const lua::PreparedCall<std::string_view()>&>);
+            static_assert(!std::is_invocable_v<const lua::PreparedCall<const char*(lua_Integer)>&, lua_Integer>);
+            static_assert(!std::is_invocable_v<const lua::PreparedCall<std::tuple<lua_Integer, std::string_view>()>&>);
+        }
+
+        DOCTEST_SUBCASE("Errors")
+        {
+            auto call = lua::PreparedCall<void(bool)>();
+            auto wrong_result = lua::PreparedCall<std::string(lua_Integer, lua_Integer)>();
+            auto s = lua::StackWindow<>(mock_state.get()).pushcfunction(lua::bind<&fail>()).prepare(call)
+                .pushcfunction(lua::bind<&add>()).prepare(wrong_result);
+            REQUIRE_THROWS_WITH(call(true), "failed");
+            REQUIRE_THROWS(wrong_result(1, 2));
+            REQUIRE(lua_gettop(mock_state.get()) == 1);
+            (void)s;
+        }
+    }
+
+    DOCTEST_SUBCASE("Coroutines")
+    {
+        lua_State* thread = nullptr;
+        auto s = lua::StackWrapper<>(mock_state.get()).newthread().tothread<1>([&thread] (lua_State* x) { thread = x; });
+        REQUIRE_STACK(s, lua::Thread);
+
+        auto t = lua::StackWrapper<>(thread);
+        auto [s2, t2] = s.pushcfunction(yield_double).pushinteger(3).xmove<2>(t);
+        REQUIRE_STACK(s2, lua::Thread);
+        REQUIRE_STACK(t2, lua::Function, lua::Integer);
+
+        auto unexpected = [] (auto) {
+            FAIL("The coroutine stopped in the wrong way");
+            return 0;
+        };
+        auto resumed = t2.resume<1>(mock_state.get(), unexpected, [unexpected] (auto yielded) {
+            REQUIRE(yielded.status() == LUA_YIELD);
+            REQUIRE(yielded.result_count() == 1);
+            auto t3 = yielded.template resolve<lua::Integer>().template tointeger<1>([] (lua_Integer x) { REQUIRE(x == 6); });
+            REQUIRE_STACK(t3, lua::Integer);
+
+            // The window holds only the arguments of the suspended coroutine, it finishes with nothing below its results.
+            return t3.template pop<1>().pushliteral("done").template resume<1>(nullptr, [] (auto returned) {
+                REQUIRE(returned.status() == LUA_OK);
+                auto t4 = returned.template resolve<lua::String>().template tolstring<1>([] (std::string_view x) { REQUIRE(x == "done"); });
+                REQUIRE_STACK(t4, lua::String);
+                return 1;
+            }, [] (auto) {
+                FAIL("The coroutine should have finished");
+                return 0;
+            }, unexpected);
+        }, unexpected);
+        REQUIRE(resumed == 1);
+
+        // Values below the function of a started coroutine are still there when it returns.
+        auto t5 = lua::StackWindow<>(thread).pushinteger(7).pushcfunction(lua::bind<&add>()).pushinteger(1).pushinteger(2);
+        auto finished = t5.resume<2>(mock_state.get(), [] (auto returned) {
+            static_assert(std::is_same_v<decltype(returned), lua::MultiRet<lua::StackWindow<lua::Integer>>>);
+            auto t6 = returned.template resolve<lua::Integer>().template tointeger<2>([] (lua_Integer x) { REQUIRE(x == 3); });
+            static_assert(std::is_same_v<decltype(t6), lua::StackWindow<lua::Integer, lua::Integer>>);
+            return t6.template pop<2>().gettop([] (int x) { REQUIRE(x == 0); });
+        }, [] (auto yielded) {
+            FAIL("The coroutine should have finished");
+            return yielded.drop();
+        }, [] (auto error) {
+            FAIL("The coroutine should have finished");
+            return error.template pop<1>();
+        });
+        static_assert(std::is_same_v<decltype(finished), lua::StackWindow<>>);
+
+        auto failed = lua::StackWindow<>(thread).pushcfunction(lua::bind<&fail>()).pushboolean(true).resume<1>(mock_state.get(), unexpected, unexpected, [] (auto error) {
+            static_assert(std::is_same_v<decltype(error), lua::StackWindow<lua::Unknown>>);
+            (void)error.template tostring<1>([] (const char* x) { REQUIRE(std::string_view(x) == "failed"); });
+            return 1;
+        });
+        REQUIRE(failed == 1);
+    }
+
+    DOCTEST_SUBCASE("Loading chunks")
+    {
+        auto loaded = [] (auto s) {
+            REQUIRE_STACK(s, lua::Function);
+            return s;
+        };
+        auto failed = [] (auto s) {
+            REQUIRE_STACK(s, lua::String);
+            FAIL("The chunk should have loaded");
+            return s.template pop<1>().pushcfunction(magic_function);
+        };
+        auto s = lua::StackWrapper<>(mock_state.get()).load("return ... * 2", "=double", loaded, failed);
+        REQUIRE_STACK(s, lua::Function);
+
+        auto bytecode = std::string();
+        auto s2 = s.dump<1>([&bytecode] (std::string_view piece) { bytecode.append(piece); });
+        REQUIRE_STACK(s2, lua::Function);
+        REQUIRE(!bytecode.empty());
+
+        auto s3 = s2.pop<1>().load(bytecode, "=double", "b", loaded, failed).pushinteger(21).call<1, 1>()
+            .tointeger<1>([] (lua_Integer x) { REQUIRE(x == 42); });
+        REQUIRE_STACK(s3, lua::Number);
+
+        auto s4 = s3.pop<1>().load(bytecode, "=double", "t", [] (auto s) {
+            FAIL("Binary chunks were refused");
+            return s.template pop<1>();
+        }, [] (auto s) {
+            REQUIRE_STACK(s, lua::String);
+            return s.template pop<1>();
+        });
+        REQUIRE_STACK(s4,);
+
+        auto s5 = s4.load("return (", "=broken", [] (auto s) {
+            return s.template pop<1>();
+        }, [] (auto s) {
+            return s.template tolstring<1>([] (std::string_view message) {
+                REQUIRE(message.find("broken") != std::string_view::npos);
+            }).template pop<1>();
+        });
+        REQUIRE_STACK(s5,);
+        REQUIRE(lua_gettop(mock_state.get()) == 0);
+
+        REQUIRE_THROWS((void)s5.pushcfunction(magic_function).dump<1>([] (std::string_view) {}));
+    }
+
+    DOCTEST_SUBCASE("Building tables from a schema")
+    {
+        auto response = Response{1, 0.5, true, "name", {10, 20, 30}};
+        auto s = lua::StackWrapper<>(mock_state.get()).pushtable(response, response_schema);
+        REQUIRE_STACK(s, lua::Table);
+        auto s2 = s.getfield<1>("id").tointeger<2>([] (lua_Integer x) { REQUIRE(x == 1); }).pop<1>()
+            .getfield<1>("score").tonumber<2>([] (lua_Number x) { REQUIRE(x == 0.5); }).pop<1>()
+            .getfield<1>("ok").toboolean<2>([] (bool x) { REQUIRE(x); }).pop<1>()
+            .getfield<1>("name").tolstring<2>([] (std::string_view x) { REQUIRE(x == "name"); }).pop<1>();
+        REQUIRE_STACK(s2, lua::Table);
+        REQUIRE(lua_rawlen(mock_state.get(), 1) == 3);
+        REQUIRE(lua_rawgeti(mock_state.get(), 1, 3) == LUA_TNUMBER);
+        REQUIRE(lua_tointeger(mock_state.get(), -1) == 30);
+    }
+
+    DOCTEST_SUBCASE("Reading tables into structs")
+    {
+        auto response = Response{1, 0.5, true, "name", {10, 20, 30}};
+        auto s = lua::StackWrapper<>(mock_state.get()).pushtable(response, response_schema);
+
+        DOCTEST_SUBCASE("Matching table")
+        {
+            auto read = Response{};
+            auto s2 = s.readtable<1>(read, response_schema, [] (lua::ReadResult result) { REQUIRE(result); });
+            REQUIRE_STACK(s2, lua::Table);
+            REQUIRE(read.id == 1);
+            REQUIRE(read.score == 0.5);
+            REQUIRE(read.ok);
+            REQUIRE(read.name == "name");
+            REQUIRE(read.values == std::vector<int>{10, 20, 30});
+
+            auto raw_read = Response{};
+            auto s3 = lua::StackWrapper<lua::Unknown>(mock_state.get())
+                .rawreadtable<-1>(raw_read, response_schema, [] (lua::ReadResult result) { REQUIRE(result); });
+            REQUIRE_STACK(s3, lua::Table);
+            REQUIRE(raw_read.name == "name");
+        }
+
+        DOCTEST_SUBCASE("Wrong field type")
+        {
+            auto s2 = s.pushliteral("not a number").setfield<1>("score");
+            auto read = Response{};
+            auto s3 = s2.readtable<1>(read, response_schema, [] (lua::ReadResult result) {
+                REQUIRE(!result);
+                REQUIRE(std::string_view(result.field) == "score");
+                REQUIRE(std::string_view(result.expected) == lua::Float::name);
+                REQUIRE(result.got == LUA_TSTRING);
+            });
+            REQUIRE_STACK(s3, lua::Table);
+            REQUIRE(read.id == 1);
+            REQUIRE(!read.ok);
+        }
+
+        DOCTEST_SUBCASE("Wrong element type")
+        {
+            lua_pushboolean(mock_state.get(), true);
+            lua_rawseti(mock_state.get(), 1, 2);
+            auto read = Response{};
+            auto s2 = s.readtable<1>(read, response_schema, [] (lua::ReadResult result) {
+                REQUIRE(!result);
+                REQUIRE(result.field == nullptr);
+                REQUIRE(result.index == 2);
+                REQUIRE(result.got == LUA_TBOOLEAN);
+            });
+            REQUIRE_STACK(s2, lua::Table);
+            REQUIRE(lua_gettop(mock_state.get()) == 1);
+        }
+
+        DOCTEST_SUBCASE("Integer out of range")
+        {
+            lua_pushinteger(mock_state.get(), lua_Integer{1} << 40);
+            lua_rawseti(mock_state.get(), 1, 2);
+            auto read = Response{};
+            auto s2 = s.readtable<1>(read, response_schema, [] (lua::ReadResult result) {
+                REQUIRE(!result);
+                REQUIRE(result.index == 2);
+                REQUIRE(std::string_view(result.expected) == lua::Integer::name);
+                REQUIRE(result.got == LUA_TNUMBER);
+            });
+            REQUIRE_STACK(s2, lua::Table);
+
+            auto values = std::vector<lua_Integer>{1, -1};
+            auto unsigned_read = std::vector<unsigned>{};
+            (void)s2.pusharray(values).toarray<2>(unsigned_read, [] (lua::ReadResult result) {
+                REQUIRE(!result);
+                REQUIRE(result.index == 2);
+            }).pop<1>();
+        }
+    }
+
+    DOCTEST_SUBCASE("Bulk arrays")
+    {
+        auto values = std::vector<lua_Integer>{1, 2, 3, 4};
+        auto s = lua::StackWrapper<>(mock_state.get()).pusharray(values);
+        REQUIRE_STACK(s, lua::Table);
+        REQUIRE(lua_rawlen(mock_state.get(), 1) == 4);
+
+        DOCTEST_SUBCASE("Into a vector")
+        {
+            auto read = std::vector<int>{};
+            auto s2 = s.toarray<1>(read, [] (lua::ReadResult result) { REQUIRE(result); });
+            REQUIRE_STACK(s2, lua::Table);
+            REQUIRE(read == std::vector<int>{1, 2, 3, 4});
+        }
+
+        DOCTEST_SUBCASE("Into a buffer")
+        {
+            double buffer[3] = {};
+            auto s2 = s.toarray<-1>(buffer, 3, [] (lua::ReadResult result, std::size_t length) {
+                REQUIRE(result);
+                REQUIRE(length == 4);
+            });
+            REQUIRE_STACK(s2, lua::Table);
+            REQUIRE(buffer[2] == 3.0);
+        }
+
+        DOCTEST_SUBCASE("Wrong element type")
+        {
+            lua_pushliteral(mock_state.get(), "string");
+            lua_rawseti(mock_state.get(), 1, 3);
+            auto read = std::vector<lua_Integer>{};
+            auto s2 = s.toarray<1>(read, [] (lua::ReadResult result) {
+                REQUIRE(!result);
+                REQUIRE(result.index == 3);
+                REQUIRE(result.got == LUA_TSTRING);
+            });
+            REQUIRE_STACK(s2, lua::Table);
+            REQUIRE(lua_gettop(mock_state.get()) == 1);
+        }
+    }
+
+    DOCTEST_SUBCASE("Iterating over tables")
+    {
+        auto values = std::vector<lua_Integer>{1, 2, 3, 4};
+        auto s = lua::StackWrapper<>(mock_state.get()).pushnil().pusharray(values).pushinteger(10).setfield<2>("ten");
+        REQUIRE_STACK(s, lua::Nil, lua::Table);
+
+        DOCTEST_SUBCASE("All pairs")
+        {
+            auto sum = lua_Integer{0};
+            auto pairs = 0;
+            auto s2 = s.for_each<2>([&sum, &pairs, &mock_state] (auto s) {
+                REQUIRE_STACK(s, lua::Nil, lua::Table, lua::Unknown, lua::Unknown);
+                REQUIRE(lua_gettop(mock_state.get()) == 4);
+                pairs++;
+                return s.template tointeger<-1>([&sum] (lua_Integer x) { sum += x; });
+            });
+            REQUIRE_STACK(s2, lua::Nil, lua::Table);
+            REQUIRE(sum == 20);
+            REQUIRE(pairs == 5);
+            REQUIRE(lua_gettop(mock_state.get()) == 2);
+        }
+
+        DOCTEST_SUBCASE("Sequence")
+        {
+            auto read = std::vector<lua_Integer>{};
+            auto s2 = s.for_each_index<-1>([&read] (auto s, lua_Integer i) {
+                REQUIRE_STACK(s, lua::Nil, lua::Table, lua::Unknown);
+                REQUIRE(i == static_cast<lua_Integer>(read.size()) + 1);
+                return s.template tointeger<3>([&read] (lua_Integer x) { read.push_back(x); });
+            });
+            REQUIRE_STACK(s2, lua::Nil, lua::Table);
+            REQUIRE(read == values);
+            REQUIRE(lua_gettop(mock_state.get()) == 2);
+        }
+
+        DOCTEST_SUBCASE("Wrong value type")
+        {
+            lua_pushliteral(mock_state.get(), "string");
+            lua_rawseti(mock_state.get(), 2, 3);
+            REQUIRE_THROWS((void)s.for_each_index<2>([] (auto s, lua_Integer) {
+                return s.template tointeger<-1>([] (lua_Integer) {});
+            }));
+        }
+    }
+
+    DOCTEST_SUBCASE("Bound functions")
+    {
+        auto s = lua::StackWrapper<>(mock_state.get());
+
+        DOCTEST_SUBCASE("One result")
+        {
+            auto s2 = s.pushcfunction(lua::bind<&add>()).pushinteger(1).pushinteger(2).call<2, 1>()
+                .tointeger<1>([] (lua_Integer x) { REQUIRE(x == 3); });
+            REQUIRE_STACK(s2, lua::Number);
+        }
+
+        DOCTEST_SUBCASE("Multiple results")
+        {
+            auto s2 = s.pushcfunction(lua::bind<&describe>()).pushliteral("name").pushinteger(2).call<2, 2>()
+                .tointeger<1>([] (lua_Integer x) { REQUIRE(x == 4); })
+                .tolstring<2>([] (std::string_view x) { REQUIRE(x == "name!"); });
+            REQUIRE_STACK(s2, lua::Number, lua::String);
+        }
+
+        DOCTEST_SUBCASE("Wrong arguments")
+        {
+            auto s2 = s.pushcfunction(lua::bind<&add>()).pushinteger(1).pushliteral("2").pcall<2, 1, 0>();
+            REQUIRE(s2.type(1) == LUA_TSTRING);
+            auto s3 = s2.resolve<lua::String>().tolstring<1>([] (std::string_view x) { REQUIRE(x == "bad argument #2 (expected an integer, got string)"); });
+            REQUIRE_STACK(s3, lua::String);
+
+            auto s4 = s3.pop<1>().pushcfunction(lua::bind<&add>()).pushinteger(1).pcall<1, 1, 0>().resolve<lua::String>()
+                .tolstring<1>([] (std::string_view x) { REQUIRE(x == "wrong number of arguments (expected 2, got 1)"); });
+            REQUIRE_STACK(s4, lua::String);
+        }
+
+        DOCTEST_SUBCASE("Exceptions")
+        {
+            auto s2 = s.pushcfunction(lua::bind<&fail>()).pushboolean(true).pcall<1, 0, 0>().resolve<lua::String>()
+                .tolstring<1>([] (std::string_view x) { REQUIRE(x == "failed"); });
+            REQUIRE_STACK(s2, lua::String);
+        }
+    }
+
     DOCTEST_SUBCASE("gettop")
     {
         auto s = lua::StackWrapper<>(mock_state.get()).pushinteger(1).pushnil().pushcfunction(some_function<0, 0>);
-        REQUIRE_STACK(s, lua::Number, lua::Nil, lua::Function);
+        REQUIRE_STACK(s, lua::Integer, lua::Nil, lua::Function);
         auto s2 = s.gettop([&s] (int x) { REQUIRE(s.stack_size == x); });
-        REQUIRE_STACK(s2, lua::Number, lua::Nil, lua::Function);
+        REQUIRE_STACK(s2, lua::Integer, lua::Nil, lua::Function);
     }
 
     DOCTEST_SUBCASE("Rotating elements")
     {
         auto s = lua::StackWrapper<>(mock_state.get()).pushinteger(1).pushnil().pushcfunction(some_function<0, 0>);
-        REQUIRE_STACK(s, lua::Number, lua::Nil, lua::Function);
+        REQUIRE_STACK(s, lua::Integer, lua::Nil, lua::Function);
         auto s2 = s.rotate<-1, 1>();
-        REQUIRE_STACK(s2, lua::Number, lua::Nil, lua::Function);
+        REQUIRE_STACK(s2, lua::Integer, lua::Nil, lua::Function);
         auto s3 = s2.rotate<-2, 1>();
-        REQUIRE_STACK(s3, lua::Number, lua::Function, lua::Nil);
+        REQUIRE_STACK(s3, lua::Integer, lua::Function, lua::Nil);
         auto s4 = s3.rotate<1, 1>();
-        REQUIRE_STACK(s4, lua::Nil, lua::Number, lua::Function);
+        REQUIRE_STACK(s4, lua::Nil, lua::Integer, lua::Function);
         auto s5 = s4.rotate<1, 2>();
-        REQUIRE_STACK(s5, lua::Number, lua::Function, lua::Nil);
+        REQUIRE_STACK(s5, lua::Integer, lua::Function, lua::Nil);
     }
 
     DOCTEST_SUBCASE("insert")
     {
         auto s = lua::StackWrapper<>(mock_state.get()).pushinteger(1).pushnil().pushcfunction(some_function<0, 0>);
-        REQUIRE_STACK(s, lua::Number, lua::Nil, lua::Function);
+        REQUIRE_STACK(s, lua::Integer, lua::Nil, lua::Function);
         auto s2 = s.insert<1>();
-        REQUIRE_STACK(s2, lua::Function, lua::Number, lua::Nil);
+        REQUIRE_STACK(s2, lua::Function, lua::Integer, lua::Nil);
     }
 
     DOCTEST_SUBCASE("Calling functions")
@@ -292,7 +1164,7 @@ TEST_CASE("stack")
         DOCTEST_SUBCASE("Nargs = 1, NResults = 0")
         {
             auto s = lua::StackWrapper<>(mock_state.get()).pushcfunction(some_function<1, 0>).pushinteger(1);
-            REQUIRE_STACK(s, lua::Function, lua::Number);
+            REQUIRE_STACK(s, lua::Function, lua::Integer);
             auto s2 = s.call<1, 0>();
             REQUIRE_STACK(s2,);
         }
@@ -308,7 +1180,7 @@ TEST_CASE("stack")
         DOCTEST_SUBCASE("Nargs = 1, NResults = 1")
         {
             auto s = lua::StackWrapper<>(mock_state.get()).pushcfunction(some_function<1, 1>).pushinteger(1);
-            REQUIRE_STACK(s, lua::Function, lua::Number);
+            REQUIRE_STACK(s, lua::Function, lua::Integer);
             auto s2 = s.call<1, 1>();
             REQUIRE_STACK(s2, lua::Unknown);
         }
@@ -341,6 +1213,19 @@ TEST_CASE("stack")
                 auto s3 = s2.resolve<>();
                 REQUIRE_STACK(s3,);
             }
+
+            DOCTEST_SUBCASE("only the results are checked")
+            {
+                auto s = lua::StackWrapper<>(mock_state.get()).pushinteger(1).pushcfunction(some_function<0, 2>);
+                // Changed behind the wrapper's back, resolve() doesn't look at it again.
+                lua_pushnil(mock_state.get());
+                lua_replace(mock_state.get(), 1);
+                auto s2 = s.call<0, LUA_MULTRET>();
+                REQUIRE_THROWS_WITH(((void)s2.resolve<lua::Number, lua::String>()), "Stack value #3 should have been a string (got `number)");
+                REQUIRE_THROWS_WITH((void)s2.resolve<lua::Number>(), "Expected stack size is 2 (got 3)");
+                auto s3 = s2.resolve<lua::Number, lua::Number>();
+                REQUIRE_STACK(s3, lua::Integer, lua::Number, lua::Number);
+            }
         }
 
         DOCTEST_SUBCASE("protected call")